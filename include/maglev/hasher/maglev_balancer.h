@@ -18,10 +18,12 @@
 #include <cmath>
 #include <ctime>
 #include <limits>
+#include <vector>
 
 #include "maglev/hasher/maglev_hasher.h"
 #include "maglev/stats/load_stats.h"
 #include "maglev/stats/load_stats_wrapper.h"
+#include "maglev/util/epoch.h"
 
 namespace maglev {
 
@@ -55,7 +57,32 @@ struct default_balance_strategy {
   int max_recover_delay_s = 600;
 
   // options
-  size_t max_try_pick_cnt = 0;  // 0 means slot_size
+  size_t max_try_pick_cnt = 0;  // 0 means slot_size, or node_size if below
+  // Retry nodes in a per key order by node_sequence(), each node at most
+  // once, instead of probing slots by rehash(), which may hit a rejected node
+  // again. A pick then fails after node_size tries at most.
+  bool node_distinct_retry = false;
+  // In heartbeat, rank only the top nodes that balance and ban rules use,
+  // plus max_rank_to_report of each rank, by partial selection on metrics
+  // snapshotted once, and without copying or sorting the node manager. Other
+  // nodes get rank node_size.
+  bool   top_k_rank         = false;
+  size_t max_rank_to_report = 0;
+  // Compute verdicts of nodes at heartbeat, so pick only tests bits of a
+  // table, except a live load check for nodes above a precomputed limit.
+  // Other stats are then judged once per heartbeat, by stats of the last
+  // heartbeat period. The table is an immutable snapshot, and pick reads
+  // nothing else but atomic counters of now. Stats read by live checks are
+  // atomic as well, so heartbeat can run in its own thread either way, but a
+  // live check may see stats of a heartbeat half done.
+  bool precomputed_verdict = false;
+
+  // verdict bits of a node
+  enum verdict_bit_t : unsigned char {
+    verdict_ban        = 1,  // should ban
+    verdict_balance    = 2,  // should balance, not by load
+    verdict_load_check = 4,  // should balance if load is above limit
+  };
 
   // ========== methods =======================================================
 
@@ -64,6 +91,99 @@ struct default_balance_strategy {
     return (key + (key % 997 + 1) * retry_cnt) % slot_size;
   }
 
+  // Same as above, but slot_mod is a modulo functor by slot size, e.g.
+  // fast_mod, to avoid hardware division.
+  template <typename SlotModType,
+            typename = typename std::enable_if<
+                !std::is_integral<SlotModType>::value>::type>
+  size_t rehash(size_t             key,
+                size_t             retry_cnt,
+                const SlotModType& slot_mod) const {
+    return slot_mod(key + (key % 997 + 1) * retry_cnt);
+  }
+
+  /**
+   * Order of nodes to retry for a key, other than the first one picked.
+   *
+   * Slots are probed by rehash() as retries without node_distinct_retry do,
+   * and nodes tried already are skipped, so the order is of owners of slots
+   * on the probe sequence of the key. It is as stable as the slot table:
+   * adding or removing a node changes the owners of a few slots only, not
+   * the order of other nodes, which an order by node indexes would. Nodes of
+   * no slot, e.g. of zero weight, are tried last, by index. next() must be
+   * called at most node_size - 1 times.
+   *
+   * Nodes tried are kept inline while few, as retries usually are, so a
+   * sequence allocates only if more than inline_tried_size nodes are tried.
+   */
+  template <typename HasherType>
+  class node_sequence_t {
+  public:
+    static constexpr size_t inline_tried_size = 8;
+
+    node_sequence_t() = default;
+    node_sequence_t(const default_balance_strategy& s,
+                    const HasherType&               h,
+                    size_t                          key,
+                    size_t                          first)
+        : s_(&s), h_(&h), key_(key) {
+      mark_tried(first);
+    }
+
+    size_t next() {
+      size_t idx;
+      do {
+        if (probe_ < h_->slot_size()) {
+          size_t slot_idx = s_->rehash(key_, ++probe_, h_->slot_mod());
+          idx             = h_->slot_array()[slot_idx];
+        } else {
+          idx = scan_++;
+        }
+      } while (is_tried(idx));
+      mark_tried(idx);
+      return idx;
+    }
+
+  private:
+    bool is_tried(size_t idx) const {
+      if (!tried_bits_.empty()) return tried_bits_[idx];
+      for (size_t i = 0; i < tried_cnt_; ++i) {
+        if (tried_[i] == idx) return true;
+      }
+      return false;
+    }
+
+    // Spill to a bitmap of all nodes once the inline array is full.
+    void mark_tried(size_t idx) {
+      if (!tried_bits_.empty()) {
+        tried_bits_[idx] = true;
+      } else if (tried_cnt_ < inline_tried_size) {
+        tried_[tried_cnt_++] = idx;
+      } else {
+        tried_bits_.assign(h_->node_size(), false);
+        for (size_t i = 0; i < tried_cnt_; ++i) tried_bits_[tried_[i]] = true;
+        tried_bits_[idx] = true;
+      }
+    }
+
+  private:
+    const default_balance_strategy* s_         = nullptr;
+    const HasherType*               h_         = nullptr;
+    size_t                          key_       = 0;
+    size_t                          probe_     = 0;  // retry_cnt of rehash()
+    size_t                          scan_      = 0;  // next node index to scan
+    size_t                          tried_cnt_ = 0;  // nodes in tried_
+    size_t                          tried_[inline_tried_size] = {};
+    std::vector<bool>               tried_bits_;  // empty until tried_ is full
+  };
+
+  template <typename HasherType>
+  node_sequence_t<HasherType> node_sequence(size_t            key,
+                                            size_t            first,
+                                            const HasherType& h) const {
+    return node_sequence_t<HasherType>(*this, h, key, first);
+  }
+
   // should_balance
 
   template <typename StatsTypeA, typename StatsTypeB>
@@ -73,18 +193,23 @@ struct default_balance_strategy {
     return false;
   }
 
-  template <typename PointValueType, size_t LoadSeqSize>
-  bool should_balance(const load_stats<PointValueType, LoadSeqSize>& n,
-                      const load_stats<PointValueType, LoadSeqSize>& g,
+  template <typename ValueType, size_t SeqSize, typename DataType>
+  bool should_balance(const load_stats<ValueType, SeqSize, DataType>& n,
+                      const load_stats<ValueType, SeqSize, DataType>& g,
                       size_t node_size) const {
     if (g.heartbeat_cnt() <= min_heartbeat_cnt_to_balance) { return false; }
     if (n.load().now() <= min_load_to_balance) { return false; }
+    return should_balance_by_load(n, g, node_size);
+  }
+
+  // Whether a node's load is too high compared with global load.
+  template <typename StatsTypeA, typename StatsTypeB>
+  bool should_balance_by_load(const StatsTypeA& n,
+                              const StatsTypeB& g,
+                              size_t            node_size) const {
     // g_load = max of now and last, or, maybe add max of sum/node_size as well
     auto g_load = std::max(g.load().now(), g.load().last());
-    if (n.load().now() * node_size > g_load * eps_of_load_to_balance) {
-      return true;
-    }
-    return false;
+    return n.load().now() * node_size > g_load * eps_of_load_to_balance;
   }
 
   template <typename LoadStatsBase,
@@ -102,17 +227,28 @@ struct default_balance_strategy {
                       size_t node_size) const {
     if (g.heartbeat_cnt() <= min_heartbeat_cnt_to_balance) { return false; }
     if (n.load().now() <= min_load_to_balance) { return false; }
+    if (!should_check_server(n, g)) { return false; }
+    if (should_balance_by_load(n, g, node_size)) { return true; }
+    return should_balance_by_server_stats(n, g, node_size);
+  }
+
+  // Gates of balancing a server by its own stats.
+  template <typename ServerLoadStatsType>
+  bool should_check_server(const ServerLoadStatsType& n,
+                           const ServerLoadStatsType& g) const {
     if (n.query().now() <= min_query_to_balance) { return false; }
     if (n.error_rate_of_window() <= min_error_rate_to_balance) { return false; }
     if (n.avg_latency_of_window() <= min_avg_latency_to_balance) {
       return false;
     }
+    return true;
+  }
 
-    // g_load = max of now and last, or, maybe add max of sum/node_size as well
-    auto g_load = std::max(g.load().now(), g.load().last());
-    if (n.load().now() * node_size > g_load * eps_of_load_to_balance) {
-      return true;
-    }
+  // Balance a server by latency or error.
+  template <typename ServerLoadStatsType>
+  bool should_balance_by_server_stats(const ServerLoadStatsType& n,
+                                      const ServerLoadStatsType& g,
+                                      size_t node_size) const {
     // balance by latency
     if (n.error_rate_of_window() > min_error_rate_to_balance_by_latency &&
         n.latency_rank() <=
@@ -143,9 +279,9 @@ struct default_balance_strategy {
     return false;
   }
 
-  template <typename PointValueType, size_t LoadSeqSize>
-  bool should_ban(const load_stats<PointValueType, LoadSeqSize>& n,
-                  const load_stats<PointValueType, LoadSeqSize>& g,
+  template <typename ValueType, size_t SeqSize, typename DataType>
+  bool should_ban(const load_stats<ValueType, SeqSize, DataType>& n,
+                  const load_stats<ValueType, SeqSize, DataType>& g,
                   size_t node_size) const {
     return false;
   }
@@ -212,6 +348,143 @@ struct default_balance_strategy {
     return false;
   }
 
+  // verdict
+  // Verdict bits of a node, see verdict_bit_t, computed at heartbeat by stats
+  // of the completed period, just before g and n are heartbeated.
+
+  template <typename StatsTypeA, typename StatsTypeB>
+  unsigned char verdict(const StatsTypeA& n,
+                        const StatsTypeB& g,
+                        size_t            node_size) const {
+    return (should_ban(n, g, node_size) ? verdict_ban : 0) |
+           (should_balance(n, g, node_size) ? verdict_balance : 0);
+  }
+
+  template <typename ValueType, size_t SeqSize, typename DataType>
+  unsigned char verdict(const load_stats<ValueType, SeqSize, DataType>& n,
+                        const load_stats<ValueType, SeqSize, DataType>& g,
+                        size_t node_size) const {
+    return g.heartbeat_cnt() + 1 > min_heartbeat_cnt_to_balance
+               ? verdict_load_check
+               : 0;
+  }
+
+  template <typename LoadStatsBase,
+            typename QueryCntType,
+            typename LatencyCntType,
+            size_t SeqSize>
+  unsigned char verdict(const server_load_stats_wrapper<LoadStatsBase,
+                                                        QueryCntType,
+                                                        LatencyCntType,
+                                                        SeqSize>& n,
+                        const server_load_stats_wrapper<LoadStatsBase,
+                                                        QueryCntType,
+                                                        LatencyCntType,
+                                                        SeqSize>& g,
+                        size_t node_size) const {
+    unsigned char v = should_ban(n, g, node_size) ? verdict_ban : 0;
+    if (g.heartbeat_cnt() + 1 > min_heartbeat_cnt_to_balance &&
+        should_check_server(n, g)) {
+      v |= verdict_load_check;
+      if (n.load().now() > min_load_to_balance &&
+          should_balance_by_server_stats(n, g, node_size)) {
+        v |= verdict_balance;
+      }
+    }
+    return v;
+  }
+
+  // Verdict and load limit of all nodes before verdicts are computed.
+  unsigned char initial_verdict() const { return 0; }
+  double        initial_load_limit() const {
+    return std::numeric_limits<double>::max();
+  }
+
+  // Load limit computed at heartbeat for nodes with verdict_load_check. Until
+  // next heartbeat, a node is balanced by load if and only if its load is
+  // above the limit and should_balance_by_load_now().
+  template <typename StatsType>
+  double load_limit(const StatsType& g, size_t node_size) const {
+    return std::numeric_limits<double>::max();
+  }
+
+  template <typename ValueType, size_t SeqSize, typename DataType>
+  double load_limit(const load_stats<ValueType, SeqSize, DataType>& g,
+                    size_t node_size) const {
+    return load_limit_of(g, node_size);
+  }
+
+  template <typename LoadStatsBase,
+            typename QueryCntType,
+            typename LatencyCntType,
+            size_t SeqSize>
+  double load_limit(const server_load_stats_wrapper<LoadStatsBase,
+                                                    QueryCntType,
+                                                    LatencyCntType,
+                                                    SeqSize>& g,
+                    size_t node_size) const {
+    return load_limit_of(g, node_size);
+  }
+
+  // Global load of now becomes last after heartbeat, so this covers
+  // min_load_to_balance and the part of should_balance_by_load() by last.
+  template <typename StatsType>
+  double load_limit_of(const StatsType& g, size_t node_size) const {
+    double l = double(g.load().now()) * eps_of_load_to_balance / node_size;
+    return std::max(l, double(min_load_to_balance));
+  }
+
+  // The part of should_balance_by_load() by global load of now, reads only
+  // atomic counters of now.
+  template <typename StatsTypeA, typename StatsTypeB>
+  bool should_balance_by_load_now(const StatsTypeA& n,
+                                  const StatsTypeB& g,
+                                  size_t            node_size) const {
+    return n.load().now() * node_size >
+           g.load().now() * eps_of_load_to_balance;
+  }
+
+  // top k rank
+
+  enum rank_metric_t {
+    rank_load,
+    rank_query,
+    rank_error,
+    rank_fatal,
+    rank_latency,
+    rank_metric_size
+  };
+
+  // Metrics of a node to rank by, larger is ranked first.
+  struct rank_row_t {
+    double v[rank_metric_size] = {};
+  };
+
+  // Call set_rank(i, r) with r in [1, k] for nodes of the k largest metric m
+  // in rows, and with r = rows.size() for the others.
+  template <typename SetRankFunc>
+  void rank_top_k(const std::vector<rank_row_t>& rows,
+                  rank_metric_t                  m,
+                  size_t                         k,
+                  SetRankFunc&&                  set_rank) const {
+    const size_t node_size = rows.size();
+    k                      = std::min(k, node_size);
+    if (k < node_size) {
+      for (size_t i = 0; i < node_size; ++i) set_rank(i, int(node_size));
+    }
+    if (k == 0) return;
+    std::vector<unsigned int> idx(node_size);
+    for (size_t i = 0; i < node_size; ++i) idx[i] = i;
+    auto cmp = [&](unsigned int l, unsigned int r) {
+      return rows[l].v[m] > rows[r].v[m];
+    };
+    if (k < node_size) {
+      std::nth_element(idx.begin(), idx.begin() + k, idx.end(), cmp);
+    }
+    std::sort(idx.begin(), idx.begin() + k, cmp);
+    for (size_t i = 0; i < k; ++i) set_rank(idx[i], int(i + 1));
+  }
+
   // heartbeat
   // return banned node count
 
@@ -220,13 +493,25 @@ struct default_balance_strategy {
     return 0;
   }
 
-  template <typename PointValueType,
-            size_t LoadSeqSize,
+  template <typename ValueType,
+            size_t SeqSize,
+            typename DataType,
             typename NodeManagerType>
-  int heartbeat(const load_stats<PointValueType, LoadSeqSize>& g,
-                NodeManagerType&                               n) const {
+  int heartbeat(const load_stats<ValueType, SeqSize, DataType>& g,
+                NodeManagerType&                                n) const {
     using node_ptr_t = typename NodeManagerType::node_ptr_t;
 
+    if (top_k_rank) {
+      std::vector<rank_row_t> rows(n.size());
+      for (size_t i = 0; i < n.size(); ++i) {
+        rows[i].v[rank_load] = double(n[i]->load().sum());
+      }
+      rank_top_k(rows, rank_load, max_rank_to_report, [&](size_t i, int r) {
+        n[i]->set_load_rank(r);
+      });
+      return 0;
+    }
+
     // load rank
     std::sort(n.begin(), n.end(), [](const node_ptr_t& l, const node_ptr_t& r) {
       return l->load().sum() > r->load().sum();
@@ -264,6 +549,11 @@ struct default_balance_strategy {
   int server_heartbeat(const ServerLoadStatsType& g, NodeManagerType& n) const {
     using node_ptr_t = typename NodeManagerType::node_ptr_t;
 
+    if (top_k_rank) {
+      server_rank_top_k(n);
+      return ban_servers(g, n);
+    }
+
     // load rank
     std::sort(n.begin(), n.end(), [](const node_ptr_t& l, const node_ptr_t& r) {
       return l->load().sum() > r->load().sum();
@@ -294,7 +584,53 @@ struct default_balance_strategy {
     });
     for (size_t i = 0; i < n.size(); ++i) { n[i]->set_latency_rank(i + 1); }
 
-    // ban
+    return ban_servers(g, n);
+  }
+
+  // Ranks in the top k of each by server_heartbeat(), with top_k_rank.
+  template <typename NodeManagerType>
+  void server_rank_top_k(NodeManagerType& n) const {
+    const size_t            node_size = n.size();
+    std::vector<rank_row_t> rows(node_size);
+    for (size_t i = 0; i < node_size; ++i) {
+      const auto& s           = n[i];
+      rows[i].v[rank_load]    = double(s->load().sum());
+      rows[i].v[rank_query]   = double(s->query().sum());
+      rows[i].v[rank_error]   = s->error_rate_of_window();
+      rows[i].v[rank_fatal]   = s->fatal_rate_of_window();
+      rows[i].v[rank_latency] = s->avg_latency_of_window();
+    }
+    // top k used by balance and ban rules
+    auto top_of = [&](double pct) {
+      return std::max(size_t(std::ceil(node_size * pct)), max_rank_to_report);
+    };
+    size_t error_k   = top_of(max_pct_of_balance_by_error);
+    size_t latency_k = top_of(max_pct_of_balance_by_latency);
+    // ban rules need fatal rank under both limits
+    size_t fatal_k = std::max(
+        std::min(size_t(std::max(max_fatal_rank_to_ban, 0)),
+                 size_t(std::ceil(node_size * max_pct_of_ban_by_fatal))),
+        max_rank_to_report);
+
+    rank_top_k(rows, rank_load, max_rank_to_report, [&](size_t i, int r) {
+      n[i]->set_load_rank(r);
+    });
+    rank_top_k(rows, rank_query, max_rank_to_report, [&](size_t i, int r) {
+      n[i]->set_query_rank(r);
+    });
+    rank_top_k(rows, rank_error, error_k, [&](size_t i, int r) {
+      n[i]->set_error_rank(r);
+    });
+    rank_top_k(rows, rank_fatal, fatal_k, [&](size_t i, int r) {
+      n[i]->set_fatal_rank(r);
+    });
+    rank_top_k(rows, rank_latency, latency_k, [&](size_t i, int r) {
+      n[i]->set_latency_rank(r);
+    });
+  }
+
+  template <typename ServerLoadStatsType, typename NodeManagerType>
+  int ban_servers(const ServerLoadStatsType& g, NodeManagerType& n) const {
     int banned_cnt = 0;
     for (const auto& i : n) {
       if (should_ban_by_delay_recover(i->load_stats(), g, n.size())) {
@@ -312,6 +648,147 @@ struct default_balance_strategy {
   }
 };
 
+/**
+ * Consistent hashing with bounded loads (Mirrokni et al.), for nodes with
+ * inflight_wrapper stats.
+ *
+ * A node is balanced if one more query would make its in-flight count exceed
+ * ceil((1 + eps) * avg), where avg counts that query as well. Since the caps
+ * sum to more than all in-flight queries, the rehash sequence of a key always
+ * reaches a node under cap. The sequence is fixed per key, so as load shifts
+ * a key only moves along it, from or to its first nodes under cap.
+ *
+ * Callers incr in-flight counts of the picked node and the global stats when
+ * sending a query, and decr them when it finishes. Concurrent picks may read
+ * counts not incremented yet, so caps hold exactly only for serial picks.
+ * Other stats of LoadStatsBase are checked as default_balance_strategy does,
+ * except the load rule.
+ */
+struct bounded_load_balance_strategy : public default_balance_strategy {
+  using base_t = default_balance_strategy;
+
+  // ========== parameters ====================================================
+
+  double eps_of_bounded_load = 0.25;
+
+  // ========== methods =======================================================
+
+  using base_t::heartbeat;
+  using base_t::load_limit;
+  using base_t::should_balance;
+  using base_t::should_balance_by_load;
+  using base_t::should_balance_by_load_now;
+  using base_t::should_ban;
+  using base_t::verdict;
+
+  // Max in-flight queries of a node, with inflight_sum queries of all nodes.
+  size_t bounded_load(size_t inflight_sum, size_t node_size) const {
+    return size_t(std::ceil((1 + eps_of_bounded_load) * inflight_sum /
+                            std::max<size_t>(node_size, 1)));
+  }
+
+  template <typename LoadStatsBase, typename InflightCntType>
+  bool should_balance(const inflight_wrapper<LoadStatsBase, InflightCntType>& n,
+                      const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+                      size_t node_size) const {
+    return should_balance_by_load(n, g, node_size) ||
+           should_balance_by_stats(base(n), base(g), node_size);
+  }
+
+  // Whether one more query exceeds the bounded load.
+  template <typename LoadStatsBase, typename InflightCntType>
+  bool should_balance_by_load(
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& n,
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+      size_t node_size) const {
+    // Counts may be negative in a moment if decr before incr in other threads.
+    auto n_cnt = std::max<InflightCntType>(n.inflight(), 0);
+    auto g_cnt = std::max<InflightCntType>(g.inflight(), 0);
+    return size_t(n_cnt) + 1 > bounded_load(size_t(g_cnt) + 1, node_size);
+  }
+
+  template <typename LoadStatsBase, typename InflightCntType>
+  bool should_balance_by_load_now(
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& n,
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+      size_t node_size) const {
+    return should_balance_by_load(n, g, node_size);
+  }
+
+  template <typename LoadStatsBase, typename InflightCntType>
+  bool should_ban(const inflight_wrapper<LoadStatsBase, InflightCntType>& n,
+                  const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+                  size_t node_size) const {
+    return base_t::should_ban(base(n), base(g), node_size);
+  }
+
+  // In-flight counts are atomic, checked live even before verdicts.
+  unsigned char initial_verdict() const { return verdict_load_check; }
+  double        initial_load_limit() const {
+    return std::numeric_limits<double>::lowest();
+  }
+
+  // In-flight counts are checked live by should_balance_by_load_now().
+  template <typename LoadStatsBase, typename InflightCntType>
+  unsigned char verdict(
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& n,
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+      size_t node_size) const {
+    return verdict_load_check |
+           (should_ban(n, g, node_size) ? verdict_ban : 0) |
+           (should_balance_by_stats(base(n), base(g), node_size)
+                ? verdict_balance
+                : 0);
+  }
+
+  template <typename LoadStatsBase, typename InflightCntType>
+  double load_limit(const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+                    size_t node_size) const {
+    return std::numeric_limits<double>::lowest();
+  }
+
+  template <typename LoadStatsBase,
+            typename InflightCntType,
+            typename NodeManagerType>
+  int heartbeat(const inflight_wrapper<LoadStatsBase, InflightCntType>& g,
+                NodeManagerType& n) const {
+    return base_t::heartbeat(base(g), n);
+  }
+
+protected:
+  template <typename LoadStatsBase, typename InflightCntType>
+  static const LoadStatsBase& base(
+      const inflight_wrapper<LoadStatsBase, InflightCntType>& s) {
+    return s;
+  }
+
+  // Balance by stats of LoadStatsBase other than load.
+  template <typename StatsType>
+  bool should_balance_by_stats(const StatsType& n,
+                               const StatsType& g,
+                               size_t           node_size) const {
+    return false;
+  }
+
+  template <typename LoadStatsBase,
+            typename QueryCntType,
+            typename LatencyCntType,
+            size_t SeqSize>
+  bool should_balance_by_stats(const server_load_stats_wrapper<LoadStatsBase,
+                                                               QueryCntType,
+                                                               LatencyCntType,
+                                                               SeqSize>& n,
+                               const server_load_stats_wrapper<LoadStatsBase,
+                                                               QueryCntType,
+                                                               LatencyCntType,
+                                                               SeqSize>& g,
+                               size_t node_size) const {
+    return g.heartbeat_cnt() > min_heartbeat_cnt_to_balance &&
+           should_check_server(n, g) &&
+           should_balance_by_server_stats(n, g, node_size);
+  }
+};
+
 template <typename MaglevHasherType =
               maglev_hasher<load_stats_wrapper<node_base<>, load_stats<>>>,
           typename BalanceStrategyType = default_balance_strategy>
@@ -337,41 +814,64 @@ public:
     size_t     consistent_node_idx = 0;        // index in node_manager
   };
 
+  // Result of pick_raw(), nodes are not owned, see pick_raw().
+  struct raw_pick_ret_t : public maglev_hasher_t::raw_pick_ret_t {
+    bool   failed        = false;
+    bool   is_consistent = true;
+    size_t retry_cnt     = 0;
+    // Different with node, node_idx if is_consistent is false
+    node_t* consistent_node     = nullptr;  // node pointer, not owned
+    size_t  consistent_node_idx = 0;        // index in node_manager
+  };
+
 public:
   maglev_balancer(maglev_hasher_ptr_t h = nullptr) {
     if (!h) { h = new maglev_hasher_t{}; }
+    h->set_generation(next_generation());
     maglev_hasher_.store(h, std::memory_order_relaxed);
   }
 
+  // No pick() should be running.
   ~maglev_balancer() {
-    set_maglev_hasher(nullptr);
-    if (old_maglev_hasher_) {
-      delete old_maglev_hasher_;
-      old_maglev_hasher_ = nullptr;
-    }
+    delete maglev_hasher_.exchange(nullptr, std::memory_order_acquire);
+    delete verdict_table_.exchange(nullptr, std::memory_order_acquire);
   }
 
+  // Replace the hasher with a built one, thread safe with pick() and other
+  // set_maglev_hasher() calls. The old one is deleted after no reader can
+  // hold it, see epoch.h. Its generation is set, so that verdicts of a hasher
+  // deleted before are not taken for it, even if it is at the same address.
+  // With precomputed_verdict, verdicts of nodes kept are carried over by
+  // node id, so bans and balancing go on until the next heartbeat.
   void set_maglev_hasher(maglev_hasher_ptr_t h) {
+    if (h) h->set_generation(next_generation());
+    epoch_guard         guard;  // old is not deleted while carried over from
     maglev_hasher_ptr_t old =
-        maglev_hasher_.exchange(h, std::memory_order_relaxed);
-    if (old_maglev_hasher_) { delete old_maglev_hasher_; }
-    old_maglev_hasher_ = old;
+        maglev_hasher_.exchange(h, std::memory_order_acq_rel);
+    if (h && old && balance_strategy().precomputed_verdict) {
+      publish_verdict_table(carried_verdict_table(*h, *old));
+    }
+    epoch_domain::global().retire(old);
   }
 
+  // The reference may be invalid after set_maglev_hasher() in other threads,
+  // unless it is used within an epoch_guard.
   const maglev_hasher_t& maglev_hasher() const {
-    maglev_hasher_ptr_t h = maglev_hasher_.load(std::memory_order_relaxed);
+    maglev_hasher_ptr_t h = maglev_hasher_.load(std::memory_order_acquire);
     assert(h);
     return *h;
   }
   maglev_hasher_t& maglev_hasher() {
-    maglev_hasher_ptr_t h = maglev_hasher_.load(std::memory_order_relaxed);
+    maglev_hasher_ptr_t h = maglev_hasher_.load(std::memory_order_acquire);
     assert(h);
     return *h;
   }
 
   // methods from maglev_hasher
 
-  void build() { maglev_hasher().build(); }
+  // Returns false if the hasher rejects to build, see
+  // maglev_hasher::is_buildable().
+  bool build() { return maglev_hasher().build(); }
 
   slot_array_t& slot_array() { return maglev_hasher().slot_array(); }
 
@@ -397,32 +897,167 @@ public:
   }
 
   pick_ret_t pick(size_t hashed_key) const {
+    epoch_guard guard;
+    // Load hasher once, slot array and nodes must be of the same one.
+    const auto& h = maglev_hasher();
+    return to_pick_ret(pick_raw_of(hashed_key, h), h);
+  }
+
+  // Same as pick(), but node pointers are not copied, so no reference count
+  // is touched, which all threads picking the same node contend on. Nodes
+  // are owned by the hasher, so call it within an epoch_guard, and nodes are
+  // valid until the guard exits, even if set_maglev_hasher() is called.
+  raw_pick_ret_t pick_raw(size_t hashed_key) const {
+    epoch_guard guard;
+    return pick_raw_of(hashed_key, maglev_hasher());
+  }
+
+  template <typename KeyType, typename HashType = def_hash_t<KeyType>>
+  pick_ret_t pick_with_auto_hash(const KeyType& key) const {
+    static auto h = HashType{};
+    return pick(h(key));
+  }
+
+  // Same as out[i] = pick(hashes[i]) for i in [0, n), but slots and nodes
+  // (with their stats) of a block are prefetched before picking. All keys
+  // are picked by one hasher, loaded once.
+  void pick_batch(const size_t* hashes, size_t n, pick_ret_t* out) const {
+    epoch_guard      guard;
+    const auto&      h     = maglev_hasher();
+    constexpr size_t block = maglev_hasher_t::pick_batch_block_size();
+    size_t           idx[block];
+    for (size_t b = 0; b < n; b += block) {
+      const size_t m = std::min(block, n - b);
+      for (size_t i = 0; i < m; ++i) {
+        idx[i] = balance_strategy().rehash(hashes[b + i], 0, h.slot_mod());
+      }
+      for (size_t i = 0; i < m; ++i) h.slot_array().prefetch(idx[i]);
+      for (size_t i = 0; i < m; ++i) {
+        prefetch(h.node_manager()[h.slot_array()[idx[i]]].get());
+      }
+      for (size_t i = 0; i < m; ++i) {
+        out[b + i] = to_pick_ret(pick_raw_of(hashes[b + i], h, idx[i]), h);
+      }
+    }
+  }
+
+  void heartbeat() {
+    epoch_guard guard;
+    if (balance_strategy().top_k_rank) {
+      // Nodes are not reordered, see default_balance_strategy::top_k_rank.
+      banned_cnt_ = balance_strategy().heartbeat(global_load(), node_manager());
+    } else {
+      auto nm_copy = node_manager();
+      banned_cnt_  = balance_strategy().heartbeat(global_load(), nm_copy);
+    }
+
+    // Verdicts are computed by stats of the heartbeat period just completed,
+    // before they are rotated.
+    if (balance_strategy().precomputed_verdict) {
+      publish_verdict_table(new_verdict_table(maglev_hasher()));
+    }
+
+    for (const auto& i : node_manager()) { i->heartbeat(); }
+    global_load_.heartbeat();
+  }
+
+  load_stats_t&       global_load() { return global_load_; }
+  const load_stats_t& global_load() const { return global_load_; }
+
+  size_t heartbeat_cnt() const { return global_load().heartbeat_cnt(); }
+
+  int banned_cnt() const { return banned_cnt_; }
+
+protected:
+  // Verdicts of nodes of a hasher, see default_balance_strategy.
+  struct verdict_table_t {
+    const maglev_hasher_t*     hasher     = nullptr;
+    size_t                     generation = 0;
+    std::vector<unsigned char> verdicts;
+    double                     load_limit = 0;
+  };
+
+  raw_pick_ret_t pick_raw_of(size_t                 hashed_key,
+                             const maglev_hasher_t& h) const {
+    return pick_raw_of(
+        hashed_key, h, balance_strategy().rehash(hashed_key, 0, h.slot_mod()));
+  }
+
+  // first_slot_idx is the slot of the first try, i.e. rehash of retry 0.
+  raw_pick_ret_t pick_raw_of(size_t                 hashed_key,
+                             const maglev_hasher_t& h,
+                             size_t                 first_slot_idx) const {
+    // Separate loops, so that the common one is not slowed by the other.
+    return balance_strategy().node_distinct_retry
+               ? pick_impl<true>(hashed_key, first_slot_idx, h)
+               : pick_impl<false>(hashed_key, first_slot_idx, h);
+  }
+
+  // Node pointers are copied once, not for each retry.
+  static pick_ret_t to_pick_ret(const raw_pick_ret_t&  r,
+                                const maglev_hasher_t& h) {
     pick_ret_t ret;
-    size_t     max_try_pick_cnt = balance_strategy().max_try_pick_cnt > 0
-                                      ? balance_strategy().max_try_pick_cnt
-                                      : slot_size();
+    ret.node                = h.node_manager()[r.node_idx];
+    ret.node_idx            = r.node_idx;
+    ret.failed              = r.failed;
+    ret.is_consistent       = r.is_consistent;
+    ret.retry_cnt           = r.retry_cnt;
+    ret.consistent_node     = h.node_manager()[r.consistent_node_idx];
+    ret.consistent_node_idx = r.consistent_node_idx;
+    return ret;
+  }
+
+  template <bool NodeDistinct>
+  raw_pick_ret_t pick_impl(size_t                 hashed_key,
+                           size_t                 first_slot_idx,
+                           const maglev_hasher_t& h) const {
+    raw_pick_ret_t ret;
+    size_t         max_try_pick_cnt = balance_strategy().max_try_pick_cnt > 0
+                                          ? balance_strategy().max_try_pick_cnt
+                                          : h.slot_size();
+    if (NodeDistinct) {
+      max_try_pick_cnt = std::min(max_try_pick_cnt, h.node_size());
+    }
+    typename balance_strategy_t::template node_sequence_t<maglev_hasher_t> seq;
+    // Verdicts are indexed by nodes of the hasher they were computed for.
+    // Without verdicts for this hasher, e.g. before the first heartbeat, all
+    // nodes get initial_verdict(), so stats being heartbeated are not read.
+    const bool             by_verdict = balance_strategy().precomputed_verdict;
+    const verdict_table_t* table = by_verdict ? verdict_table_of(h) : nullptr;
+    const double load_limit = table ? table->load_limit
+                                    : balance_strategy().initial_load_limit();
     for (size_t retry_cnt = 0;; ++retry_cnt) {
       if (retry_cnt == max_try_pick_cnt) {
         ret.failed = true;
         break;
       }
-      size_t slot_idx =
-          balance_strategy().rehash(hashed_key, retry_cnt, slot_size());
-      size_t node_idx = slot_array()[slot_idx];
+      size_t node_idx;
+      if (retry_cnt == 0) {
+        node_idx = h.slot_array()[first_slot_idx];
+      } else if (!NodeDistinct) {
+        size_t slot_idx =
+            balance_strategy().rehash(hashed_key, retry_cnt, h.slot_mod());
+        node_idx = h.slot_array()[slot_idx];
+      } else {
+        if (retry_cnt == 1) {
+          seq = balance_strategy().node_sequence(
+              hashed_key, ret.consistent_node_idx, h);
+        }
+        node_idx = seq.next();
+      }
       if (retry_cnt == 0) {
         ret.consistent_node_idx = node_idx;
-        ret.consistent_node     = node_manager()[node_idx];
+        ret.consistent_node     = h.node_manager()[node_idx].get();
       }
       ret.node_idx      = node_idx;
-      ret.node          = node_manager()[node_idx];
+      ret.node          = h.node_manager()[node_idx].get();
       ret.retry_cnt     = retry_cnt;
       ret.is_consistent = ret.node_idx == ret.consistent_node_idx;
-      if (balance_strategy().should_balance(
-              ret.node->load_stats(), global_load(), node_size())) {
-        continue;
-      }
-      if (balance_strategy().should_ban(
-              ret.node->load_stats(), global_load(), node_size())) {
+      if (by_verdict) {
+        unsigned char v = table ? table->verdicts[node_idx]
+                                : balance_strategy().initial_verdict();
+        if (should_skip_by_verdict(v, load_limit, ret.node, h)) continue;
+      } else if (should_skip(ret.node, h)) {
         continue;
       }
       ret.failed = false;
@@ -431,30 +1066,86 @@ public:
     return ret;
   }
 
-  template <typename KeyType, typename HashType = def_hash_t<KeyType>>
-  pick_ret_t pick_with_auto_hash(const KeyType& key) const {
-    static auto h = HashType{};
-    return pick(h(key));
+  // Verdict table of hasher h, or nullptr if the table is of another one.
+  const verdict_table_t* verdict_table_of(const maglev_hasher_t& h) const {
+    const verdict_table_t* t = verdict_table_.load(std::memory_order_acquire);
+    return t && t->hasher == &h && t->generation == h.generation() ? t
+                                                                   : nullptr;
   }
 
-  void heartbeat() {
-    auto nm_copy = node_manager();
-    banned_cnt_  = balance_strategy().heartbeat(global_load(), nm_copy);
+  void publish_verdict_table(verdict_table_t* t) {
+    verdict_table_t* old =
+        verdict_table_.exchange(t, std::memory_order_acq_rel);
+    epoch_domain::global().retire(old);
+  }
 
-    for (auto i : node_manager()) { i->heartbeat(); }
-    global_load_.heartbeat();
+  verdict_table_t* new_verdict_table(const maglev_hasher_t& h) const {
+    auto*  t = new verdict_table_t;
+    size_t n = h.node_size();
+    t->hasher     = &h;
+    t->generation = h.generation();
+    t->load_limit = balance_strategy().load_limit(global_load(), n);
+    t->verdicts.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      t->verdicts[i] = balance_strategy().verdict(
+          h.node_manager()[i]->load_stats(), global_load(), n);
+    }
+    return t;
   }
 
-  load_stats_t&       global_load() { return global_load_; }
-  const load_stats_t& global_load() const { return global_load_; }
+  // Verdicts of nodes of h are those of the same nodes of prev, by node id,
+  // and initial_verdict() for nodes added, or if prev has no verdicts. The
+  // load limit is kept until the next heartbeat.
+  verdict_table_t* carried_verdict_table(const maglev_hasher_t& h,
+                                         const maglev_hasher_t& prev) const {
+    const verdict_table_t* old = verdict_table_of(prev);
+    auto*                  t   = new verdict_table_t;
+    size_t                 n   = h.node_size();
+    t->hasher     = &h;
+    t->generation = h.generation();
+    t->load_limit =
+        old ? old->load_limit : balance_strategy().initial_load_limit();
+    t->verdicts.assign(n, balance_strategy().initial_verdict());
+    if (!old) return t;
+    for (size_t i = 0; i < n; ++i) {
+      const auto& node = h.node_manager()[i];
+      size_t      j    = prev.node_manager().find_idx_by_node_id(
+          node->id(), node->id_hash());
+      if (j != node_manager_t::npos) t->verdicts[i] = old->verdicts[j];
+    }
+    return t;
+  }
 
-  size_t heartbeat_cnt() const { return global_load().heartbeat_cnt(); }
+  size_t next_generation() {
+    return generation_.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
 
-  int banned_cnt() const { return banned_cnt_; }
+  bool should_skip(const node_t* node, const maglev_hasher_t& h) const {
+    return balance_strategy().should_balance(
+               node->load_stats(), global_load(), h.node_size()) ||
+           balance_strategy().should_ban(
+               node->load_stats(), global_load(), h.node_size());
+  }
+
+  bool should_skip_by_verdict(unsigned char          v,
+                              double                 load_limit,
+                              const node_t*          node,
+                              const maglev_hasher_t& h) const {
+    using strategy_t = balance_strategy_t;
+    if (v & (strategy_t::verdict_ban | strategy_t::verdict_balance)) {
+      return true;
+    }
+    if (!(v & strategy_t::verdict_load_check)) return false;
+    // Only counters of now are read live, see load_limit().
+    if (node->load().now() <= load_limit) return false;
+    return balance_strategy().should_balance_by_load_now(
+        node->load_stats(), global_load(), h.node_size());
+  }
 
 protected:
   std::atomic<maglev_hasher_ptr_t> maglev_hasher_{nullptr};
-  maglev_hasher_ptr_t              old_maglev_hasher_{nullptr};
+  std::atomic<verdict_table_t*>    verdict_table_{nullptr};
+  std::atomic<size_t>              generation_{0};
 
   load_stats_t global_load_;
 
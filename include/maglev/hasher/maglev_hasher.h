@@ -14,9 +14,14 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
-#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <limits>
+#include <numeric>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "maglev/hasher/slot_array.h"
@@ -27,7 +32,10 @@
 #include "maglev/node_manager/node_manager_base.h"
 #include "maglev/node_manager/weighted_node_manager_wrapper.h"
 #include "maglev/permutation/permutation_generator.h"
+#include "maglev/util/bitmap.h"
 #include "maglev/util/hash.h"
+#include "maglev/util/prefetch.h"
+#include "maglev/util/thread_pool.h"
 #include "maglev/util/type_traits.h"
 
 namespace maglev {
@@ -46,21 +54,49 @@ class maglev_hasher {
 public:
   using slot_array_t        = SlotArrayType;
   using slot_int_t          = typename slot_array_t::int_t;
+  using slot_mod_t          = typename slot_array_t::mod_t;
   using perm_gen_t          = PermutationGeneratorType;
   using perm_gen_array_t    = std::vector<perm_gen_t>;
   using node_manager_t      = NodeManagerType;
   using node_t              = typename node_manager_t::node_t;
   using node_ptr_t          = typename node_manager_t::node_ptr_t;
   using node_manager_item_t = typename node_manager_t::item_t;
+  using node_id_t           = typename node_t::node_id_t;
 
   struct pick_ret_t {
     node_manager_item_t node     = nullptr;  // node pointer
     size_t              node_idx = 0;        // index in node_manager
   };
 
+  // Result of pick_raw(), node is not owned, see pick_raw().
+  struct raw_pick_ret_t {
+    node_t* node     = nullptr;  // node pointer, not owned
+    size_t  node_idx = 0;        // index in node_manager
+  };
+
+  // Membership changes applied by diff_rebuild() or diff_rebuild_from().
+  struct membership_delta_t {
+    std::vector<node_manager_item_t> add;     // new nodes, ids in use ignored
+    std::vector<node_id_t>           remove;  // ids of nodes to remove
+    // (id, new weight) of nodes to reweight, only for weighted nodes
+    std::vector<std::pair<node_id_t, unsigned int>> reweight;
+
+    bool empty() const {
+      return add.empty() && remove.empty() && reweight.empty();
+    }
+  };
+
+  struct rebuild_ret_t {
+    bool      rebuilt        = false;  // false if membership not changed
+    bool      failed         = false;  // build rejected, see is_buildable()
+    size_t    moved_slot_cnt = 0;      // slots mapped to a different node
+    long long build_time_us  = 0;      // time cost in microseconds
+  };
+
 protected:
   using is_slot_counted_node_t     = is_slot_counted_t<node_t>;
   using is_weighted_node_manager_t = is_weighted_t<node_manager_t>;
+  using is_bit_packed_slot_array_t = is_bit_packed_t<slot_array_t>;
 
 public:
   maglev_hasher() {}
@@ -76,15 +112,45 @@ public:
 
   size_t slot_size() const { return slot_array_.size(); }
 
+  // Modulo by slot size without division, decided at build time.
+  const slot_mod_t& slot_mod() const { return slot_mod_; }
+
   node_manager_t& node_manager() { return node_manager_; }
 
   const node_manager_t& node_manager() const { return node_manager_; }
 
   size_t node_size() const { return node_manager_.size(); }
 
+  // Count of virtual nodes in the slot table, see
+  // node_manager_base::set_vnode_cnt().
+  size_t vnode_size() const { return node_size() * node_manager_.vnode_cnt(); }
+
+  // Build is rejected if there are fewer slots per node, or per vnode with
+  // vnodes, or imbalance may be more than 10%, see slot_size_for().
+  static constexpr size_t min_slots_per_node() { return 10; }
+
+  // Whether build() accepts the node manager and slot array, i.e. there is
+  // at least one node, and at least min_slots_per_node() slots per vnode.
+  bool is_buildable() const {
+    return node_size() > 0 &&
+           vnode_size() <= slot_size() / min_slots_per_node();
+  }
+
+  // In exact quota mode, each node gets exactly round(M * w / W) slots by the
+  // largest remainder method, for M slots and weight sum W (w = 1 for
+  // unweighted nodes), and build needs neither rand nor rejection.
+  void set_exact_quota(bool exact_quota) { exact_quota_ = exact_quota; }
+
+  bool exact_quota() const { return exact_quota_; }
+
+  // Set by the owner of the hasher, to tell it from an earlier hasher at the
+  // same address, see maglev_balancer::set_maglev_hasher().
+  size_t generation() const { return generation_; }
+  void   set_generation(size_t g) { generation_ = g; }
+
   pick_ret_t pick(size_t hashed_key) const {
     pick_ret_t ret;
-    ret.node_idx = slot_array_[hashed_key % slot_size()];
+    ret.node_idx = slot_array_[slot_mod_(hashed_key)];
     ret.node     = node_manager_[ret.node_idx];
     return ret;
   }
@@ -95,42 +161,422 @@ public:
     return pick(h(key));
   }
 
-  void build() {
+  // Same as pick(), but the node pointer is not copied, so no reference count
+  // is touched. The node is owned by the node manager, valid until the node
+  // is removed from it, or the hasher is destroyed.
+  raw_pick_ret_t pick_raw(size_t hashed_key) const {
+    raw_pick_ret_t ret;
+    ret.node_idx = slot_array_[slot_mod_(hashed_key)];
+    ret.node     = node_manager_[ret.node_idx].get();
+    return ret;
+  }
+
+  static constexpr size_t pick_batch_block_size() { return 16; }
+
+  // Same as out[i] = pick(hashes[i]) for i in [0, n), but pipelined by
+  // blocks: get slot indexes, prefetch slots, prefetch nodes, then resolve,
+  // so that cache misses of a block overlap instead of being serialized.
+  void pick_batch(const size_t* hashes, size_t n, pick_ret_t* out) const {
+    constexpr size_t block = pick_batch_block_size();
+    size_t           idx[block];
+    for (size_t b = 0; b < n; b += block) {
+      const size_t m = std::min(block, n - b);
+      for (size_t i = 0; i < m; ++i) idx[i] = slot_mod_(hashes[b + i]);
+      for (size_t i = 0; i < m; ++i) slot_array_.prefetch(idx[i]);
+      for (size_t i = 0; i < m; ++i) {
+        idx[i] = slot_array_[idx[i]];
+        prefetch(node_manager_[idx[i]].get());
+      }
+      for (size_t i = 0; i < m; ++i) {
+        out[b + i].node_idx = idx[i];
+        out[b + i].node     = node_manager_[idx[i]];
+      }
+    }
+  }
+
+  // Returns false and changes nothing if !is_buildable().
+  bool build() {
+    if (!is_buildable()) return false;
+    if (exact_quota_) {
+      inline_executor executor;
+      build_by_quota(executor);
+      return true;
+    }
     init_slot_array();
     init_node_manager();
     auto       p = make_perm_gen_array();
-    const auto n = node_size();
-    for (size_t node_idx = 0, slot_distributed_cnt = 0;
+    const auto n = vnode_size();
+    for (size_t i = 0, slot_distributed_cnt = 0;
          slot_distributed_cnt < slot_size();) {
-      select_once(p[node_idx],
-                  node_idx,
-                  slot_distributed_cnt,
-                  is_weighted_node_manager_t{});
-      if (++node_idx >= n) node_idx = 0;
+      size_t node_idx = node_idx_of(i);
+      select_once(
+          p[i], node_idx, slot_distributed_cnt, is_weighted_node_manager_t{});
+      if (++i >= n) i = 0;
     }
+    return true;
+  }
+
+  // Build in parallel by an executor, e.g. maglev::thread_pool, see
+  // thread_pool.h for requirements of an executor.
+  // The result is bit-identical to build(). Turns are taken in the same order
+  // as build(), and cut into batches of several rounds. In a batch, vnodes
+  // taking turns find their next free slots ahead in parallel while the table
+  // is read only, then the turns are resolved sequentially. Only the search
+  // is parallel, and it dominates only with large tables, so the speedup is
+  // sublinear, see the build_parallel benchmark.
+  template <typename ExecutorType>
+  bool build(ExecutorType& executor) {
+    if (!is_buildable()) return false;
+    if (exact_quota_) {
+      build_by_quota(executor);
+      return true;
+    }
+    init_slot_array();
+    init_node_manager();
+    auto                p = make_perm_gen_array();
+    const auto          n = vnode_size();
+    candidate_buffer_t  buf(n);
+    std::vector<size_t> turn;
+    for (size_t i = 0, slot_distributed_cnt = 0;
+         slot_distributed_cnt < slot_size();) {
+      // Never more turns than free slots, as build() stops when the table
+      // is full.
+      const size_t free_cnt = slot_size() - slot_distributed_cnt;
+      const size_t batch    = batch_turn_cnt(free_cnt);
+      turn.clear();
+      while (turn.size() < batch) {
+        if (take_turn(p[i], node_idx_of(i), is_weighted_node_manager_t{})) {
+          turn.push_back(i);
+        }
+        if (++i >= n) i = 0;
+      }
+      distribute_turns(executor, p, turn, free_cnt, buf);
+      slot_distributed_cnt += turn.size();
+    }
+    return true;
+  }
+
+  // Use a slot array built before, e.g. a slot_view of a snapshot loaded by
+  // load_snapshot(), instead of build(). Node manager must be ready and the
+  // same as the one the slot array was built with.
+  void load_slot_array(slot_array_t slot_array) {
+    assert(node_manager_.is_sorted());
+    slot_array_ = std::move(slot_array);
+    slot_mod_   = slot_mod_t(slot_size());
+  }
+
+  // Build in parallel with a temporary thread pool.
+  bool build_parallel(size_t thread_num = std::thread::hardware_concurrency()) {
+    if (thread_num <= 1 || !is_buildable()) return build();
+    thread_pool pool(thread_num);
+    return build(pool);
+  }
+
+  // Apply a membership delta on this built hasher, rebuild it, and diff the
+  // new slot array with the old one. This is a diffing rebuild, not an
+  // incremental one: if the delta changes anything, the slot array is rebuilt
+  // by a full build() on the new node list, so build time is not saved. Only
+  // the old node list and slot array are kept, to count moved slots.
+  rebuild_ret_t diff_rebuild(const membership_delta_t& delta) {
+    auto start = std::chrono::steady_clock::now();
+
+    rebuild_ret_t  ret;
+    node_manager_t prev_nodes(node_manager_);
+    weight_log_t   old_weights;
+    if (apply_delta(delta, old_weights)) {
+      const slot_array_t prev_slots(slot_array_);
+      build_and_diff(prev_nodes, prev_slots, old_weights, ret);
+    }
+
+    ret.build_time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    return ret;
+  }
+
+  // Make nodes of this built hasher the same as a full node list, e.g. pushed
+  // by service discovery, and rebuild only if the membership or any weight is
+  // changed. Nodes of ids already here are kept with their stats, see
+  // diff_rebuild_from().
+  rebuild_ret_t apply_membership(
+      const std::vector<node_manager_item_t>& new_list) {
+    auto diff = node_manager_.diff_membership(new_list);
+    if (diff.empty()) return rebuild_ret_t{};
+    membership_delta_t delta;
+    delta.add      = std::move(diff.add);
+    delta.remove   = std::move(diff.remove);
+    delta.reweight = std::move(diff.reweight);
+    return diff_rebuild(delta);
+  }
+
+  // Rebuild this hasher on base of a previous built hasher and a membership
+  // delta, and diff the slot array with prev's, as diff_rebuild(). Node
+  // objects are shared with prev, so their stats are kept. Reweighted nodes
+  // are reweighted in place, so prev sees the new weights too, but its slot
+  // array is unchanged. Slot counts of shared slot counted nodes are of the
+  // last build. If the delta changes nothing, prev's slot array is reused.
+  rebuild_ret_t diff_rebuild_from(const maglev_hasher&      prev,
+                                  const membership_delta_t& delta) {
+    auto start = std::chrono::steady_clock::now();
+
+    rebuild_ret_t ret;
+    // slot array is copied for its size even if it is rebuilt
+    exact_quota_  = prev.exact_quota();
+    slot_array_   = prev.slot_array();
+    slot_mod_     = prev.slot_mod();
+    node_manager_ = prev.node_manager();
+    weight_log_t old_weights;
+    if (apply_delta(delta, old_weights)) {
+      build_and_diff(
+          prev.node_manager(), prev.slot_array(), old_weights, ret);
+    }
+
+    ret.build_time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    return ret;
   }
 
 protected:
-  void init_node_manager() { node_manager_.ready_go(); }
+  // Turns of a node in exact quota mode. Round of the next turn is stepped
+  // by numerator (2k + 1) * R and denominator 2q, free of division.
+  struct quota_turn_t {
+    size_t left      = 0;  // turns left
+    size_t round     = 0;  // round of next turn
+    size_t rem       = 0;  // remainder of round
+    size_t step      = 0;  // 2R / 2q
+    size_t step_rem  = 0;  // 2R % 2q
+    size_t round_den = 0;  // 2q
+  };
+
+  // Build in exact quota mode. With R as max quota, the k-th (from 0) of q
+  // turns of a node is taken in round floor((2k + 1) * R / 2q), so turns of
+  // each node are spread evenly over R rounds, at most one in a round.
+  // Nodes in a round take turns in order of node index, and find their next
+  // free slots in parallel as build(executor). Virtual nodes of a node share
+  // its quota, and take turns as nodes.
+  template <typename ExecutorType>
+  void build_by_quota(ExecutorType& executor) {
+    init_slot_array();
+    init_node_manager();
+    auto         p = make_perm_gen_array();
+    const auto   q = make_vnode_quotas();
+    const size_t n = vnode_size();
+    const size_t r = q.empty() ? 0 : *std::max_element(q.begin(), q.end());
+    const auto   npos = (unsigned int)(-1);
+    // Nodes of a round are linked by next, from head of the round.
+    std::vector<unsigned int> head(r, npos), next(n, npos);
+    std::vector<quota_turn_t> s(n);
+    auto link = [&](size_t i) {
+      assert(s[i].round < r);
+      next[i]          = head[s[i].round];
+      head[s[i].round] = (unsigned int)i;
+    };
+    for (size_t i = 0; i < n; ++i) {
+      if (q[i] == 0) continue;
+      auto& t     = s[i];
+      t.left      = q[i];
+      t.round_den = 2 * q[i];
+      t.round     = r / t.round_den;
+      t.rem       = r % t.round_den;
+      t.step      = 2 * r / t.round_den;
+      t.step_rem  = 2 * r % t.round_den;
+      link(i);
+    }
+    // Rounds are batched as build(executor), links of the next rounds are
+    // known before slots of this round are distributed.
+    candidate_buffer_t  buf(n);
+    std::vector<size_t> turn;
+    for (size_t round = 0, slot_distributed_cnt = 0; round < r; ++round) {
+      const size_t b = turn.size();
+      for (auto i = head[round]; i != npos; i = next[i]) turn.push_back(i);
+      std::sort(turn.begin() + b, turn.end());
+      for (size_t k = b; k < turn.size(); ++k) {
+        auto& t = s[turn[k]];
+        if (--t.left == 0) continue;
+        t.round += t.step;
+        t.rem += t.step_rem;
+        if (t.rem >= t.round_den) {
+          t.rem -= t.round_den;
+          ++t.round;
+        }
+        link(turn[k]);
+      }
+      const size_t free_cnt = slot_size() - slot_distributed_cnt;
+      if (round + 1 < r && turn.size() < batch_turn_cnt(free_cnt)) continue;
+      distribute_turns(executor, p, turn, free_cnt, buf);
+      slot_distributed_cnt += turn.size();
+      turn.clear();
+    }
+  }
+
+  // Quota of a node is split evenly to its vnodes, the first ones take the
+  // remainder.
+  std::vector<size_t> make_vnode_quotas() const {
+    const size_t k = node_manager_.vnode_cnt();
+    const size_t n = node_size();
+    auto         q = make_quotas();
+    if (k == 1) return q;
+    std::vector<size_t> vq(vnode_size());
+    for (size_t v = 0; v < vq.size(); ++v) {
+      vq[v] = q[v % n] / k + (v / n < q[v % n] % k ? 1 : 0);
+    }
+    return vq;
+  }
+
+  // Slot quota of each node, which sums up to slot size.
+  std::vector<size_t> make_quotas() const {
+    const size_t                    n = node_size();
+    std::vector<unsigned long long> w(n);
+    unsigned long long              w_sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      w[i] = quota_weight(i, is_weighted_node_manager_t{});
+      w_sum += w[i];
+    }
+    if (w_sum == 0) {  // all zero weight, same as unweighted
+      std::fill(w.begin(), w.end(), 1);
+      w_sum = n;
+    }
+    std::vector<size_t>             q(n);
+    std::vector<unsigned long long> rem(n);
+    size_t                          left = slot_size();
+    for (size_t i = 0; i < n; ++i) {
+#if defined(__SIZEOF_INT128__)
+      const uint128_t x = uint128_t(slot_size()) * w[i];
+#else
+      const unsigned long long x = 1ULL * slot_size() * w[i];
+#endif
+      q[i]   = size_t(x / w_sum);
+      rem[i] = (unsigned long long)(x % w_sum);
+      left -= q[i];
+    }
+    // largest remainders round up, ties broken by node index
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&rem](size_t a, size_t b) {
+      return rem[a] > rem[b] || (rem[a] == rem[b] && a < b);
+    });
+    for (size_t i = 0; i < left; ++i) ++q[order[i]];
+    return q;
+  }
+
+  unsigned long long quota_weight(size_t node_idx, std::true_type) const {
+    return std::min(node_manager_[node_idx]->weight(),
+                    node_manager_.limited_max_weight());
+  }
+
+  unsigned long long quota_weight(size_t node_idx, std::false_type) const {
+    return 1;
+  }
+
+  // Rounds of turns in a batch of build(executor).
+  static constexpr size_t build_batch_rounds() { return 8; }
+
+  // Turns of a batch: several rounds, so that threads meet less often, but
+  // no more than a quarter of free slots, so that candidates found ahead are
+  // seldom taken by earlier turns of the batch.
+  size_t batch_turn_cnt(size_t free_cnt) const {
+    return std::min(std::max(free_cnt / 4, size_t(1)),
+                    vnode_size() * build_batch_rounds());
+  }
+
+  // Free slots found ahead by vnodes, in order of their permutations.
+  struct candidate_buffer_t {
+    std::vector<std::vector<size_t>> slots;   // candidates of each vnode
+    std::vector<size_t>              used;    // candidates used of each vnode
+    std::vector<size_t>              need;    // turns in batch of each vnode
+    std::vector<size_t>              active;  // vnodes of need > 0
+
+    explicit candidate_buffer_t(size_t n) : slots(n), used(n), need(n) {}
+  };
+
+  // Distribute a slot to each vnode in turn, in order of turns, which is the
+  // same as distributing one by one. Vnodes taking turns find candidates,
+  // their next free slots, in parallel while the table is read only. A
+  // candidate may be taken by an earlier turn, so it is checked again when
+  // used, and a vnode out of candidates goes on probing by itself. Candidates
+  // left are kept for the next batch. At most free_cnt candidates are kept
+  // for a vnode, so its permutation is never wrapped.
+  template <typename ExecutorType>
+  void distribute_turns(ExecutorType&              executor,
+                        perm_gen_array_t&          p,
+                        const std::vector<size_t>& turn,
+                        size_t                     free_cnt,
+                        candidate_buffer_t&        buf) {
+    for (auto i : turn) {
+      if (buf.need[i]++ == 0) buf.active.push_back(i);
+    }
+    executor.parallel_for(buf.active.size(), [&](size_t begin, size_t end) {
+      for (size_t k = begin; k < end; ++k) {
+        const size_t i = buf.active[k];
+        auto&        c = buf.slots[i];
+        size_t       j = 0;
+        for (size_t x = buf.used[i]; x < c.size(); ++x) {
+          if (!is_slot_distributed(c[x])) c[j++] = c[x];
+        }
+        c.resize(j);
+        buf.used[i] = 0;
+        // one more, in case one is taken by an earlier turn
+        const size_t want = std::min(buf.need[i] + 1, free_cnt);
+        while (c.size() < want) c.push_back(next_free_slot(p[i]));
+      }
+    });
+    for (auto i : turn) {
+      const auto& c = buf.slots[i];
+      auto&       u = buf.used[i];
+      while (u < c.size() && is_slot_distributed(c[u])) ++u;
+      size_t t = u < c.size() ? c[u++] : next_free_slot(p[i]);
+      distribut_slot(t, node_idx_of(i), is_slot_counted_node_t{});
+    }
+    for (auto i : buf.active) buf.need[i] = 0;
+    buf.active.clear();
+  }
+
+  void init_node_manager() {
+    node_manager_.ready_go();
+    reset_slot_cnts(is_slot_counted_node_t{});
+  }
+
+  // Slot counts are counted from zero by each build, nodes may be shared
+  // with a previous hasher.
+  void reset_slot_cnts(std::true_type) {
+    for (const auto& n : node_manager_) n->set_slot_cnt(0);
+  }
+
+  void reset_slot_cnts(std::false_type) {}
 
   constexpr slot_int_t slot_initial_value() const { return slot_int_t(-1); }
 
+  // Every slot will be written by build, so only the occupancy bitmap is
+  // initialized. Probing the dense bitmap instead of slot array keeps the
+  // hot part of build in cache.
   void init_slot_array() {
-    memset(
-        (void*)slot_array_.data(), -1, sizeof(slot_int_t) * slot_array_.size());
+    assert(is_buildable());
+    init_slot_width(is_bit_packed_slot_array_t{});
+    slot_bitmap_.reset(slot_size());
+    slot_mod_ = slot_mod_t(slot_size());
+  }
+
+  // Bit-packed slot array uses just enough bits for node indexes.
+  void init_slot_width(std::true_type) {
+    slot_array_.set_bits_for(node_size() > 0 ? node_size() - 1 : 0);
   }
 
-  bool is_slot_distributed(size_t idx) const {
-    return slot_array_[idx] != slot_initial_value();
+  void init_slot_width(std::false_type) {
+    assert(node_size() == 0 ||
+           node_size() - 1 <= size_t(std::numeric_limits<slot_int_t>::max()));
   }
 
+  bool is_slot_distributed(size_t idx) const { return slot_bitmap_.test(idx); }
+
   void distribut_slot(size_t slot_idx, size_t node_idx, std::true_type) {
-    slot_array_[slot_idx] = (slot_int_t)node_idx;
+    distribut_slot(slot_idx, node_idx, std::false_type{});
     node_manager_[node_idx]->incr_slot_cnt();
   }
 
   void distribut_slot(size_t slot_idx, size_t node_idx, std::false_type) {
-    slot_array_[slot_idx] = (slot_int_t)node_idx;
+    slot_bitmap_.set(slot_idx);
+    slot_array_.set(slot_idx, (slot_int_t)node_idx);
   }
 
   // for weighted nodes
@@ -138,11 +584,7 @@ protected:
                    size_t&     node_idx,
                    size_t&     slot_distributed_cnt,
                    std::true_type) {
-    auto& node = node_manager_[node_idx];
-    bool  slected =
-        1ULL * perm_gen.my_rand() * node_manager_.limited_max_weight() <=
-        1ULL * node->weight() * perm_gen.my_rand_max();
-    if (slected) {
+    if (take_turn(perm_gen, node_idx, std::true_type{})) {
       select_once(perm_gen, node_idx, slot_distributed_cnt, std::false_type{});
     }
   }
@@ -162,20 +604,171 @@ protected:
     }
   }
 
-  perm_gen_t make_a_perm_gen(const node_ptr_t& i) const {
-    return perm_gen_t(slot_size(), i->id_hash());
+  // (node, old weight) of nodes reweighted by apply_delta()
+  using weight_log_t =
+      std::vector<std::pair<node_manager_item_t, unsigned int>>;
+
+  // Apply delta on node_manager_, which must be sorted. Returns whether the
+  // membership or any weight is changed. Reweighted nodes are kept, only
+  // their weights are changed in place, old ones logged to old_weights.
+  bool apply_delta(const membership_delta_t& delta, weight_log_t& old_weights) {
+    bool changed = false;
+    for (const auto& i : delta.reweight) {
+      size_t idx = node_manager_.find_idx_by_node_id(i.first);
+      if (idx == node_manager_t::npos) continue;
+      changed |= reweight_node(node_manager_[idx],
+                               i.second,
+                               &old_weights,
+                               is_weighted_node_manager_t{});
+    }
+    if (!delta.remove.empty()) {
+      std::vector<bool> removed(node_size(), false);
+      for (const auto& id : delta.remove) {
+        size_t idx = node_manager_.find_idx_by_node_id(id);
+        if (idx != node_manager_t::npos) removed[idx] = true;
+      }
+      size_t j = 0;
+      for (size_t i = 0; i < node_size(); ++i) {
+        if (!removed[i]) node_manager_[j++] = std::move(node_manager_[i]);
+      }
+      changed |= j < node_size();
+      node_manager_.resize(j);
+    }
+    // Nodes left are sorted, ids of them or of adds before are skipped.
+    std::vector<node_manager_item_t> add(delta.add);
+    std::stable_sort(add.begin(), add.end(), node_manager_t::item_cmp);
+    const size_t kept_size = node_size();
+    for (size_t i = 0; i < add.size(); ++i) {
+      if (i > 0 && !(*add[i - 1] < *add[i])) continue;
+      auto it = std::lower_bound(node_manager_.begin(),
+                                 node_manager_.begin() + kept_size,
+                                 add[i],
+                                 node_manager_t::item_cmp);
+      if (it != node_manager_.begin() + kept_size && !(*add[i] < **it)) {
+        continue;
+      }
+      node_manager_.push_back(add[i]);
+      changed = true;
+    }
+    return changed;
+  }
+
+  bool reweight_node(const node_manager_item_t& n,
+                     unsigned int               w,
+                     weight_log_t*              old_weights,
+                     std::true_type) {
+    if (n->weight() == w) return false;
+    if (old_weights) old_weights->emplace_back(n, n->weight());
+    n->set_weight(w);
+    return true;
+  }
+
+  bool reweight_node(const node_manager_item_t& n,
+                     unsigned int               w,
+                     weight_log_t*              old_weights,
+                     std::false_type) {
+    return false;
+  }
+
+  // Build on the node list applied a delta, and count slots moved from
+  // prev_slots of prev_nodes. If the build is rejected, prev_nodes and the
+  // old weights are restored.
+  void build_and_diff(const node_manager_t& prev_nodes,
+                      const slot_array_t&   prev_slots,
+                      const weight_log_t&   old_weights,
+                      rebuild_ret_t&        ret) {
+    if (build()) {
+      ret.rebuilt        = true;
+      ret.moved_slot_cnt = count_moved_slots(prev_nodes, prev_slots);
+      return;
+    }
+    ret.failed = true;
+    for (const auto& i : old_weights) {
+      reweight_node(i.first, i.second, nullptr, is_weighted_node_manager_t{});
+    }
+    node_manager_ = prev_nodes;
+  }
+
+  // Count slots whose node is different between prev and this.
+  // Both node managers must be sorted.
+  size_t count_moved_slots(const node_manager_t& pnm,
+                           const slot_array_t&   prev_slots) const {
+    const auto npos  = size_t(-1);
+    auto       pnidx = std::vector<size_t>(pnm.size(), npos);
+    for (size_t i = 0, j = 0; i < pnm.size() && j < node_size();) {
+      if (*pnm[i] < *node_manager_[j]) {
+        ++i;
+      } else if (*node_manager_[j] < *pnm[i]) {
+        ++j;
+      } else {
+        pnidx[i++] = j++;
+      }
+    }
+    if (prev_slots.size() != slot_size()) return slot_size();
+    size_t cnt = 0;
+    for (size_t s = 0; s < slot_size(); ++s) {
+      cnt += pnidx[prev_slots[s]] != size_t(slot_array_[s]);
+    }
+    return cnt;
+  }
+
+  // Whether a node takes its turn to distribute a slot.
+  bool take_turn(perm_gen_t& perm_gen, size_t node_idx, std::true_type) {
+    auto& node = node_manager_[node_idx];
+    return 1ULL * perm_gen.my_rand() * node_manager_.limited_max_weight() <=
+           1ULL * node->weight() * perm_gen.my_rand_max();
+  }
+
+  bool take_turn(perm_gen_t& perm_gen, size_t node_idx, std::false_type) {
+    return true;
+  }
+
+  // Find next free slot by permutation without distributing it.
+  size_t next_free_slot(perm_gen_t& perm_gen) const {
+    while (true) {
+      auto t = perm_gen.gen_one_num();
+      if (!is_slot_distributed(t)) return t;
+    }
+  }
+
+  // Vnode 0 is seeded by id_hash() as the node, so a hasher of one vnode
+  // per node is the same as without vnodes.
+  perm_gen_t make_a_perm_gen(const node_ptr_t& i, size_t vid = 0) const {
+    size_t seed = i->id_hash();
+    if (vid > 0) {
+      seed = maglev_int_hash<unsigned long long>{}(
+          seed ^ (vid * 0x9e3779b97f4a7c15ull));
+    }
+    return perm_gen_t(slot_size(), seed);
   }
 
+  // Permutations of all vnodes, vnode vid of node i is at vid * N + i for N
+  // nodes. Vnodes take turns in this order, so in a partial last round each
+  // node gets at most one slot more than others, not up to k.
   perm_gen_array_t make_perm_gen_array() const {
+    const size_t     k = node_manager_.vnode_cnt();
     perm_gen_array_t p;
-    p.reserve(node_size());
-    for (const auto& i : node_manager_) { p.push_back(make_a_perm_gen(i)); }
+    p.reserve(vnode_size());
+    for (size_t vid = 0; vid < k; ++vid) {
+      for (const auto& i : node_manager_) {
+        p.push_back(make_a_perm_gen(i, vid));
+      }
+    }
     return p;
   }
 
+  size_t node_idx_of(size_t vnode_idx) const {
+    const size_t n = node_size();
+    return vnode_idx < n ? vnode_idx : vnode_idx % n;
+  }
+
 private:
   slot_array_t   slot_array_;
+  slot_mod_t     slot_mod_;
   node_manager_t node_manager_;
+  bitmap         slot_bitmap_;  // whether a slot is distributed during build
+  bool           exact_quota_ = false;
+  size_t         generation_  = 0;
 };
 
 }  // namespace maglev
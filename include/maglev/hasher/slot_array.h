@@ -15,13 +15,30 @@
 #pragma once
 
 #include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <type_traits>
 #include <vector>
 
+#include "maglev/util/fast_mod.h"
+#include "maglev/util/prefetch.h"
 #include "maglev/util/prime.h"
 
 namespace maglev {
 
+/// Least slot size so that slot counts of N unweighted nodes differ from the
+/// average by no more than max_imbalance times of it. Each node takes one
+/// slot in a round, so slot counts differ by at most 1 and N / max_imbalance
+/// slots are enough, e.g. 100 slots per node for 1%. Usable at compile time.
+inline constexpr size_t slot_size_for(size_t node_num,
+                                      double max_imbalance = 0.01) {
+  assert(max_imbalance > 0);
+  size_t m = size_t(node_num / max_imbalance);
+  if (m * max_imbalance < node_num) ++m;
+  return next_prime(m > 2 ? m : 2);
+}
+
 template <typename IntType = int, size_t SlotNum = 65537>
 class slot_array : public std::array<IntType, SlotNum> {
   using base_t = std::array<IntType, SlotNum>;
@@ -30,6 +47,11 @@ public:
   using int_t = typename std::enable_if<std::is_integral<IntType>::value &&
                                             is_prime(SlotNum),
                                         IntType>::type;
+  using mod_t = const_mod<SlotNum>;  // modulo by slot size
+
+  void set(size_t i, int_t v) { (*this)[i] = v; }
+
+  void prefetch(size_t i) const { maglev::prefetch(this->data() + i); }
 };
 
 template <typename IntType = int, typename AllocType = std::allocator<IntType>>
@@ -41,6 +63,7 @@ class slot_vector : public std::vector<IntType, AllocType> {
 public:
   using int_t =
       typename std::enable_if<std::is_integral<IntType>::value, IntType>::type;
+  using mod_t = fast_mod;  // modulo by slot size
 
 public:
   slot_vector() {}
@@ -56,6 +79,168 @@ public:
     assert(is_prime(n));
     base_t::resize(n, v);
   }
+
+  void set(size_t i, int_t v) { (*this)[i] = v; }
+
+  void prefetch(size_t i) const { maglev::prefetch(this->data() + i); }
+};
+
+/// A read only view of slot entries stored elsewhere, e.g. in a memory mapped
+/// snapshot, see snapshot.h. A hasher using it is loaded rather than built.
+template <typename IntType = int>
+class slot_view {
+public:
+  using int_t =
+      typename std::enable_if<std::is_integral<IntType>::value, IntType>::type;
+  using mod_t = fast_mod;  // modulo by slot size
+
+public:
+  slot_view() {}
+
+  slot_view(const int_t* data, size_t n) : data_(data), n_(n) {
+    assert(n == 0 || is_prime(n));
+  }
+
+  const int_t* data() const { return data_; }
+
+  size_t size() const { return n_; }
+
+  const int_t& operator[](size_t i) const {
+    assert(i < n_);
+    return data_[i];
+  }
+
+  const int_t* begin() const { return data_; }
+
+  const int_t* end() const { return data_ + n_; }
+
+  void prefetch(size_t i) const { maglev::prefetch(data_ + i); }
+
+private:
+  const int_t* data_ = nullptr;
+  size_t       n_    = 0;
+};
+
+/// Narrowest unsigned integer type to hold node index of MaxNodeNum nodes.
+template <size_t MaxNodeNum>
+struct slot_int_for {
+  static_assert(MaxNodeNum > 0, "MaxNodeNum must be positive");
+  using type = typename std::conditional<
+      MaxNodeNum <= 0x100ULL,
+      std::uint8_t,
+      typename std::conditional<MaxNodeNum <= 0x10000ULL,
+                                std::uint16_t,
+                                std::uint32_t>::type>::type;
+};
+
+template <size_t MaxNodeNum>
+using slot_int_for_t = typename slot_int_for<MaxNodeNum>::type;
+
+// A slot_array using narrowest entry width for at most MaxNodeNum nodes,
+// e.g. 64KB instead of 256KB for 65537 slots and no more than 256 nodes.
+template <size_t MaxNodeNum, size_t SlotNum = 65537>
+using narrow_slot_array = slot_array<slot_int_for_t<MaxNodeNum>, SlotNum>;
+
+template <size_t MaxNodeNum>
+using narrow_slot_vector = slot_vector<slot_int_for_t<MaxNodeNum>>;
+
+/// A slot vector with entries bit-packed, each entry takes ceil(log2(N)) bits
+/// for N nodes, which is decided at build time by maglev_hasher.
+/// Reading an entry is still a single unaligned 8 bytes load.
+template <typename IntType = unsigned int>
+class packed_slot_vector {
+  static_assert(std::is_integral<IntType>::value &&
+                    std::is_unsigned<IntType>::value && sizeof(IntType) <= 4,
+                "packed_slot_vector needs an unsigned int type within 32 bits");
+
+public:
+  using bit_packed_t = void;  // for type trait
+  using int_t        = IntType;
+  using mod_t        = fast_mod;  // modulo by slot size
+
+  static constexpr size_t max_bits() { return sizeof(int_t) * 8; }
+
+public:
+  packed_slot_vector() {}
+
+  packed_slot_vector(size_t n, size_t bits = max_bits()) {
+    assert(is_prime(n));
+    reset(n, bits);
+  }
+
+  void resize(size_t n) {
+    assert(is_prime(n));
+    reset(n, bits_);
+  }
+
+  size_t size() const { return n_; }
+
+  size_t bits() const { return bits_; }
+
+  // Set bits of each entry, all entries are reset to 0.
+  void set_bits(size_t bits) { reset(n_, bits); }
+
+  // Set bits of each entry to hold values in [0, max_value].
+  void set_bits_for(size_t max_value) {
+    size_t bits = 1;
+    while (bits < max_bits() && (max_value >> bits) > 0) ++bits;
+    set_bits(bits);
+  }
+
+  // Bytes of packed entries.
+  size_t bytes() const { return (n_ * bits_ + 7) / 8; }
+
+  void prefetch(size_t i) const {
+    maglev::prefetch(data_.data() + i * bits_ / 8);
+  }
+
+  int_t operator[](size_t i) const {
+    assert(i < n_);
+    size_t pos = i * bits_;
+    return int_t((load(pos / 8) >> (pos % 8)) & mask_);
+  }
+
+  void set(size_t i, int_t v) {
+    assert(i < n_);
+    assert((v & mask_) == v);
+    size_t         pos = i * bits_;
+    std::uint64_t  w   = load(pos / 8);
+    const unsigned sh  = pos % 8;
+    w                  = (w & ~(mask_ << sh)) | (std::uint64_t(v) << sh);
+    std::memcpy(data_.data() + pos / 8, &w, sizeof(w));
+  }
+
+  bool operator==(const packed_slot_vector& r) const {
+    if (n_ != r.n_ || bits_ != r.bits_) return false;
+    for (size_t i = 0; i < n_; ++i) {
+      if ((*this)[i] != r[i]) return false;
+    }
+    return true;
+  }
+
+  bool operator!=(const packed_slot_vector& r) const { return !(*this == r); }
+
+private:
+  void reset(size_t n, size_t bits) {
+    assert(bits >= 1 && bits <= max_bits());
+    n_    = n;
+    bits_ = bits;
+    mask_ = (std::uint64_t(1) << bits) - 1;
+    // 8 more bytes so that loading 8 bytes from any entry is in range
+    data_.assign(bytes() + sizeof(std::uint64_t), 0);
+  }
+
+  std::uint64_t load(size_t byte_idx) const {
+    std::uint64_t w;
+    std::memcpy(&w, data_.data() + byte_idx, sizeof(w));
+    return w;
+  }
+
+private:
+  size_t                     n_    = 0;
+  size_t                     bits_ = max_bits();
+  std::uint64_t              mask_ = (std::uint64_t(1) << max_bits()) - 1;
+  std::vector<unsigned char> data_;
 };
 
 }  // namespace maglev
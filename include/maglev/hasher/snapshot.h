@@ -0,0 +1,424 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "maglev/hasher/slot_array.h"
+#include "maglev/util/hash.h"
+#include "maglev/util/type_traits.h"
+
+namespace maglev {
+
+/**
+ * Binary snapshot of a built maglev_hasher, which can be memory mapped and
+ * serve pick() by a slot_view on the mapped pages directly.
+ *
+ * Layout, all integers in host byte order:
+ *   snapshot_header
+ *   node table: for each node in node manager order,
+ *               u32 weight, u32 id bytes, id bytes padded to 8 bytes
+ *   slot table: slot entries, aligned to 64 bytes and padded to 8 bytes
+ * Checksum is fnv1a_64_words of the whole file with the checksum field as 0.
+ */
+struct snapshot_header {
+  std::uint64_t magic;               // snapshot_magic(), also checks byte order
+  std::uint32_t version;             // snapshot_version()
+  std::uint32_t flags;               // build parameters, snapshot_flag_t
+  std::uint64_t slot_size;           // slot num
+  std::uint64_t node_size;           // node num
+  std::uint32_t slot_int_bytes;      // bytes of a slot entry
+  std::uint32_t limited_max_weight;  // 0 for unweighted nodes
+  std::uint64_t node_table_offset;
+  std::uint64_t node_table_bytes;
+  std::uint64_t slot_table_offset;
+  std::uint64_t slot_table_bytes;
+  std::uint64_t checksum;
+};
+
+static_assert(std::is_standard_layout<snapshot_header>::value &&
+                  sizeof(snapshot_header) == 80,
+              "snapshot_header layout must be stable");
+
+enum snapshot_flag_t : std::uint32_t {
+  snapshot_weighted    = 1,
+  snapshot_exact_quota = 2,
+};
+
+inline constexpr std::uint64_t snapshot_magic() {
+  return 0x50414e5356474c4dULL;  // "MGLVSNAP"
+}
+
+inline constexpr std::uint32_t snapshot_version() { return 1; }
+
+/// How node ids are stored in snapshot, specialize it for other id types.
+template <typename NodeIdType, typename Enable = void>
+struct snapshot_id_codec;
+
+template <typename IntType>
+struct snapshot_id_codec<
+    IntType,
+    typename std::enable_if<std::is_integral<IntType>::value>::type> {
+  static std::string encode(IntType id) {
+    auto v = static_cast<std::int64_t>(id);
+    return std::string(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+
+  static bool decode(const char* data, size_t n, IntType& id) {
+    if (n != sizeof(std::int64_t)) return false;
+    std::int64_t v;
+    std::memcpy(&v, data, sizeof(v));
+    id = static_cast<IntType>(v);
+    return true;
+  }
+};
+
+template <>
+struct snapshot_id_codec<std::string> {
+  static std::string encode(const std::string& id) { return id; }
+
+  static bool decode(const char* data, size_t n, std::string& id) {
+    id.assign(data, n);
+    return true;
+  }
+};
+
+namespace snapshot_detail {
+
+inline constexpr size_t align_up(size_t n, size_t a) {
+  return (n + a - 1) / a * a;
+}
+
+template <typename NodePtrType>
+std::uint32_t weight_of(const NodePtrType& n, std::true_type) {
+  return n->weight();
+}
+
+template <typename NodePtrType>
+std::uint32_t weight_of(const NodePtrType& n, std::false_type) {
+  return 0;
+}
+
+template <typename NodeManagerType>
+std::uint32_t limited_max_weight(const NodeManagerType& nm, std::true_type) {
+  return nm.limited_max_weight();
+}
+
+template <typename NodeManagerType>
+std::uint32_t limited_max_weight(const NodeManagerType& nm, std::false_type) {
+  return 0;
+}
+
+// Node table as in file, not padded to 64 bytes.
+template <typename NodeManagerType>
+std::string make_node_table(const NodeManagerType& nm) {
+  using node_t  = typename NodeManagerType::node_t;
+  using codec_t = snapshot_id_codec<typename node_t::node_id_t>;
+  std::string ret;
+  for (const auto& n : nm) {
+    const std::string   id = codec_t::encode(n->id());
+    const std::uint32_t w  = weight_of(n, is_weighted_t<node_t>{});
+    const auto          sz = static_cast<std::uint32_t>(id.size());
+    ret.append(reinterpret_cast<const char*>(&w), sizeof(w));
+    ret.append(reinterpret_cast<const char*>(&sz), sizeof(sz));
+    ret.append(id);
+    ret.resize(align_up(ret.size(), 8), '\0');
+  }
+  return ret;
+}
+
+}  // namespace snapshot_detail
+
+/// Write a snapshot of a built hasher to path. The file is written to a
+/// temporary path first and renamed, so readers never see a partial file.
+/// Returns false on IO error.
+template <typename HasherType>
+bool write_snapshot(const HasherType& h, const std::string& path) {
+  using slot_array_t = typename HasherType::slot_array_t;
+  using int_t        = typename HasherType::slot_int_t;
+  using node_t       = typename HasherType::node_t;
+  static_assert(!is_bit_packed_t<slot_array_t>::value,
+                "bit-packed slot array is not supported by snapshot");
+
+  const auto& nm         = h.node_manager();
+  std::string node_table = snapshot_detail::make_node_table(nm);
+
+  snapshot_header hd;
+  std::memset(&hd, 0, sizeof(hd));
+  hd.magic   = snapshot_magic();
+  hd.version = snapshot_version();
+  hd.flags   = (is_weighted_t<node_t>::value
+                    ? std::uint32_t(snapshot_weighted)
+                    : std::uint32_t(0)) |
+             (h.exact_quota() ? std::uint32_t(snapshot_exact_quota)
+                              : std::uint32_t(0));
+  hd.slot_size          = h.slot_size();
+  hd.node_size          = nm.size();
+  hd.slot_int_bytes     = sizeof(int_t);
+  hd.limited_max_weight = snapshot_detail::limited_max_weight(
+      nm, is_weighted_t<typename HasherType::node_manager_t>{});
+  hd.node_table_offset = sizeof(hd);
+  hd.node_table_bytes  = node_table.size();
+  hd.slot_table_offset =
+      snapshot_detail::align_up(sizeof(hd) + node_table.size(), 64);
+  hd.slot_table_bytes =
+      snapshot_detail::align_up(h.slot_size() * sizeof(int_t), 8);
+
+  node_table.resize(hd.slot_table_offset - sizeof(hd), '\0');
+  std::vector<int_t> slots(h.slot_array().begin(), h.slot_array().end());
+  slots.resize(hd.slot_table_bytes / sizeof(int_t), 0);
+
+  std::uint64_t c = fnv1a_64_words(&hd, sizeof(hd));
+  c               = fnv1a_64_words(node_table.data(), node_table.size(), c);
+  c               = fnv1a_64_words(slots.data(), hd.slot_table_bytes, c);
+  hd.checksum     = c;
+
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<const char*>(&hd), sizeof(hd));
+    os.write(node_table.data(), node_table.size());
+    os.write(reinterpret_cast<const char*>(slots.data()), hd.slot_table_bytes);
+    if (!os.flush()) {
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+/// A read only memory mapped snapshot file.
+class snapshot {
+public:
+  snapshot() {}
+
+  ~snapshot() { close(); }
+
+  snapshot(const snapshot&)            = delete;
+  snapshot& operator=(const snapshot&) = delete;
+
+  snapshot(snapshot&& r) noexcept { swap(r); }
+
+  snapshot& operator=(snapshot&& r) noexcept {
+    if (this != &r) {
+      close();
+      swap(r);
+    }
+    return *this;
+  }
+
+  // Map a snapshot file. Returns false if it can't be mapped or it is not a
+  // valid snapshot. Verifying checksum reads the whole file once. Without
+  // it, node records and slot entries are still checked to be in bounds,
+  // which reads the node table and the slot table once.
+  bool open(const std::string& path, bool verify_checksum = true) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(header_t)) {
+      ::close(fd);
+      return false;
+    }
+    void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    data_  = static_cast<const char*>(p);
+    bytes_ = st.st_size;
+    if (!is_valid(verify_checksum)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (data_) ::munmap(const_cast<char*>(data_), bytes_);
+    data_  = nullptr;
+    bytes_ = 0;
+  }
+
+  bool is_open() const { return data_ != nullptr; }
+
+  const snapshot_header& header() const {
+    assert(is_open());
+    return *reinterpret_cast<const snapshot_header*>(data_);
+  }
+
+  size_t slot_size() const { return header().slot_size; }
+
+  size_t node_size() const { return header().node_size; }
+
+  bool is_weighted() const { return header().flags & snapshot_weighted; }
+
+  bool exact_quota() const { return header().flags & snapshot_exact_quota; }
+
+  // Slot entries on mapped pages, IntType must have the same size as in file.
+  template <typename IntType = int>
+  maglev::slot_view<IntType> slots() const {
+    assert(header().slot_int_bytes == sizeof(IntType));
+    return maglev::slot_view<IntType>(
+        reinterpret_cast<const IntType*>(data_ + header().slot_table_offset),
+        slot_size());
+  }
+
+  // Call f(weight, id_data, id_bytes) for each node in order.
+  template <typename Function>
+  void for_each_node(Function f) const {
+    const char* p = data_ + header().node_table_offset;
+    for (size_t i = 0; i < node_size(); ++i) {
+      std::uint32_t w, sz;
+      std::memcpy(&w, p, sizeof(w));
+      std::memcpy(&sz, p + sizeof(w), sizeof(sz));
+      f(w, p + sizeof(w) + sizeof(sz), size_t(sz));
+      p += snapshot_detail::align_up(sizeof(w) + sizeof(sz) + sz, 8);
+    }
+  }
+
+  // Whether nodes in a ready node manager are the same as in snapshot, with
+  // the same order, ids and weights.
+  template <typename NodeManagerType>
+  bool verify(const NodeManagerType& nm) const {
+    using node_t  = typename NodeManagerType::node_t;
+    using codec_t = snapshot_id_codec<typename node_t::node_id_t>;
+    if (!is_open() || nm.size() != node_size()) return false;
+    if (is_weighted() != is_weighted_t<node_t>::value) return false;
+    bool   ok = true;
+    size_t i  = 0;
+    for_each_node([&](std::uint32_t w, const char* id, size_t sz) {
+      if (!ok) return;
+      const auto& n = nm[i++];
+      ok = codec_t::encode(n->id()) == std::string(id, sz) &&
+           w == snapshot_detail::weight_of(n, is_weighted_t<node_t>{});
+    });
+    return ok;
+  }
+
+private:
+  using header_t = snapshot_header;
+
+  bool is_valid(bool verify_checksum) const {
+    const auto& h = header();
+    if (h.magic != snapshot_magic() || h.version != snapshot_version()) {
+      return false;
+    }
+    // Sizes are bounded by file size first, so that sums can't overflow.
+    if (h.node_table_offset != sizeof(header_t) ||
+        h.node_table_bytes > bytes_ || h.slot_table_offset > bytes_ ||
+        h.slot_table_bytes > bytes_ ||
+        h.node_table_offset + h.node_table_bytes > h.slot_table_offset ||
+        h.slot_table_offset % 64 != 0 || h.slot_table_bytes % 8 != 0 ||
+        h.slot_table_offset + h.slot_table_bytes != bytes_ ||
+        !is_valid_slot_int_bytes(h.slot_int_bytes) ||
+        h.slot_size > h.slot_table_bytes / h.slot_int_bytes) {
+      return false;
+    }
+    if (h.slot_size < 2 || !is_prime(h.slot_size)) return false;
+    if (!is_valid_node_table(h)) return false;
+    if (!verify_checksum) return is_valid_slot_table(h);
+    header_t hd = h;
+    hd.checksum = 0;
+    std::uint64_t c = fnv1a_64_words(&hd, sizeof(hd));
+    c = fnv1a_64_words(data_ + sizeof(hd), bytes_ - sizeof(hd), c);
+    return c == h.checksum;
+  }
+
+  static bool is_valid_slot_int_bytes(std::uint32_t n) {
+    return n == 1 || n == 2 || n == 4 || n == 8;
+  }
+
+  // Whether the node table is exactly node_size padded node records, so
+  // that for_each_node() never reads out of it.
+  bool is_valid_node_table(const header_t& h) const {
+    const char*  p    = data_ + h.node_table_offset;
+    const size_t head = 2 * sizeof(std::uint32_t);
+    size_t       left = h.node_table_bytes;
+    for (size_t i = 0; i < h.node_size; ++i) {
+      if (left < head) return false;
+      std::uint32_t sz;
+      std::memcpy(&sz, p + sizeof(std::uint32_t), sizeof(sz));
+      const size_t rec = snapshot_detail::align_up(head + size_t(sz), 8);
+      if (rec > left) return false;
+      p += rec;
+      left -= rec;
+    }
+    return left == 0;
+  }
+
+  // Whether all slot entries are node indexes less than node_size.
+  bool is_valid_slot_table(const header_t& h) const {
+    switch (h.slot_int_bytes) {
+      case 1: return are_slots_less_than<std::uint8_t>(h);
+      case 2: return are_slots_less_than<std::uint16_t>(h);
+      case 4: return are_slots_less_than<std::uint32_t>(h);
+      default: return are_slots_less_than<std::uint64_t>(h);
+    }
+  }
+
+  // Entries are read as unsigned, so negative ones are rejected too.
+  template <typename UIntType>
+  bool are_slots_less_than(const header_t& h) const {
+    const char* p = data_ + h.slot_table_offset;
+    for (size_t i = 0; i < h.slot_size; ++i) {
+      UIntType v;
+      std::memcpy(&v, p + i * sizeof(v), sizeof(v));
+      if (v >= h.node_size) return false;
+    }
+    return true;
+  }
+
+  void swap(snapshot& r) {
+    std::swap(data_, r.data_);
+    std::swap(bytes_, r.bytes_);
+  }
+
+private:
+  const char* data_  = nullptr;
+  size_t      bytes_ = 0;
+};
+
+/// Load a hasher using slot_view from a snapshot without building. Nodes must
+/// have been added to the hasher's node manager, and they are verified
+/// against the snapshot. The snapshot must outlive the hasher.
+template <typename HasherType>
+bool load_snapshot(HasherType& h, const snapshot& s) {
+  using int_t = typename HasherType::slot_int_t;
+  static_assert(std::is_same<typename HasherType::slot_array_t,
+                             maglev::slot_view<int_t>>::value,
+                "hasher must use slot_view to load a snapshot");
+  if (!s.is_open() || s.header().slot_int_bytes != sizeof(int_t)) {
+    return false;
+  }
+  h.node_manager().ready_go();
+  if (!s.verify(h.node_manager())) return false;
+  h.load_slot_array(s.slots<int_t>());
+  h.set_exact_quota(s.exact_quota());
+  return true;
+}
+
+}  // namespace maglev
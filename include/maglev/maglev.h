@@ -21,6 +21,7 @@
 #include "maglev/node/server_node_base.h"
 #include "maglev/node/slot_counted_node_wrapper.h"
 #include "maglev/node/weighted_node_wrapper.h"
+#include "maglev/node_manager/arena_node_manager.h"
 #include "maglev/node_manager/node_manager_base.h"
 #include "maglev/node_manager/weighted_node_manager_wrapper.h"
 #include "maglev/permutation/permutation_generator.h"
@@ -28,8 +29,17 @@
 #include "maglev/stats/cycle_array.h"
 #include "maglev/stats/load_stats.h"
 #include "maglev/stats/load_stats_wrapper.h"
+#include "maglev/stats/outcome_record.h"
+#include "maglev/stats/sharded_counter.h"
 #include "maglev/stats/sliding_window.h"
+#include "maglev/util/aligned_new.h"
+#include "maglev/util/bitmap.h"
+#include "maglev/util/epoch.h"
+#include "maglev/util/fast_mod.h"
 #include "maglev/util/hash.h"
+#include "maglev/util/heartbeat_scheduler.h"
+#include "maglev/util/prefetch.h"
 #include "maglev/util/prime.h"
+#include "maglev/util/thread_pool.h"
 #include "maglev/util/type_traits.h"
 #include "maglev/wrapper/extra_wrapper.h"
@@ -34,11 +34,12 @@ public:
 
 public:
   template <typename... Args>
-  node_base(Args&&... args) : id_(std::forward<Args>(args)...) {}
+  node_base(Args&&... args)
+      : id_(std::forward<Args>(args)...), id_hash_(hash_t{}(id_)) {}
 
-  node_base(const node_id_t& id) : id_(id) {}
+  node_base(const node_id_t& id) : id_(id), id_hash_(hash_t{}(id_)) {}
 
-  node_base(node_id_t&& id) : id_(std::move(id)) {}
+  node_base(node_id_t&& id) : id_(std::move(id)), id_hash_(hash_t{}(id_)) {}
 
   // delete copy and move
   node_base(const node_base&)            = delete;
@@ -46,9 +47,10 @@ public:
   node_base& operator=(const node_base&) = delete;
   node_base& operator=(node_base&&)      = delete;
 
-  node_id_t id() const { return id_; }
+  const node_id_t& id() const { return id_; }
 
-  size_t id_hash() const { return hash_t{}(id()); }
+  // Hash of id is computed once, since id never changes.
+  size_t id_hash() const { return id_hash_; }
 
   bool operator<(const node_base& rhs) const { return id() < rhs.id(); }
 
@@ -62,6 +64,7 @@ public:
 
 private:
   node_id_t id_;  // node id should be unique
+  size_t    id_hash_;
 };
 
 template <typename Char, typename Traits, typename IdType, typename HashType>
@@ -68,7 +68,9 @@ std::basic_ostream<Char, Traits>& operator<<(
   return os;
 }
 
-/// A virtual server node with member ip, port and virtual-id.
+/// A virtual server node with member ip, port and virtual-id. Virtual nodes of
+/// a server have their own stats, to share one node and its stats, see
+/// node_manager_base::set_vnode_cnt().
 template <typename NodeBaseType = node_base<std::string>>
 class virtual_server_node_base : public server_node_base<NodeBaseType> {
   using base_t = server_node_base<NodeBaseType>;
@@ -0,0 +1,173 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "maglev/node_manager/node_manager_base.h"
+
+namespace maglev {
+
+/// Contiguous storage of equal sized blocks, each cacheline aligned, in large
+/// chunks that are never moved, so block addresses are stable until the arena
+/// is destroyed. Freed blocks are reused by later allocations.
+class node_arena {
+public:
+  static constexpr size_t cacheline_size = 64;
+
+public:
+  explicit node_arena(size_t chunk_block_cnt = 256)
+      : chunk_block_cnt_(chunk_block_cnt > 0 ? chunk_block_cnt : 1) {}
+
+  ~node_arena() {
+    for (void* c : chunks_) ::operator delete(c);
+  }
+
+  node_arena(const node_arena&)            = delete;
+  node_arena& operator=(const node_arena&) = delete;
+
+  // All blocks of an arena have the size of the first allocation.
+  void* allocate(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (block_size_ == 0) {
+      block_size_ = (bytes + cacheline_size - 1) / cacheline_size *
+                    cacheline_size;
+    }
+    if (bytes > block_size_) throw std::bad_alloc();
+    if (!free_.empty()) {
+      void* p = free_.back();
+      free_.pop_back();
+      return p;
+    }
+    if (next_ == end_) new_chunk();
+    void* p = next_;
+    next_ += block_size_;
+    return p;
+  }
+
+  void deallocate(void* p) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    free_.push_back(p);
+  }
+
+  size_t block_size() const { return block_size_; }
+  size_t chunk_cnt() const { return chunks_.size(); }
+
+private:
+  void new_chunk() {
+    size_t bytes = block_size_ * chunk_block_cnt_;
+    void*  c     = ::operator new(bytes + cacheline_size);
+    chunks_.push_back(c);
+    auto addr = reinterpret_cast<std::uintptr_t>(c);
+    addr      = (addr + cacheline_size - 1) / cacheline_size * cacheline_size;
+    next_     = reinterpret_cast<char*>(addr);
+    end_      = next_ + bytes;
+  }
+
+private:
+  const size_t       chunk_block_cnt_;
+  size_t             block_size_ = 0;
+  std::vector<void*> chunks_;
+  std::vector<void*> free_;
+  char*              next_ = nullptr;
+  char*              end_  = nullptr;
+  std::mutex         mtx_;
+};
+
+/// Allocator of a node_arena, for std::allocate_shared, which places the
+/// reference counts and the node in one block. The node is at the same
+/// offset of each block, after the counts, so it is cacheline aligned only if
+/// its type is, e.g. of stats of an outcome_record. The arena is kept alive
+/// by the allocator, i.e. until all its nodes are destroyed.
+template <typename T>
+class node_arena_allocator {
+public:
+  using value_type = T;
+
+  template <typename U>
+  friend class node_arena_allocator;
+
+public:
+  explicit node_arena_allocator(std::shared_ptr<node_arena> a)
+      : arena_(std::move(a)) {}
+
+  template <typename U>
+  node_arena_allocator(const node_arena_allocator<U>& r) : arena_(r.arena_) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) { arena_->deallocate(p); }
+
+  template <typename U>
+  bool operator==(const node_arena_allocator<U>& r) const {
+    return arena_ == r.arena_;
+  }
+  template <typename U>
+  bool operator!=(const node_arena_allocator<U>& r) const {
+    return arena_ != r.arena_;
+  }
+
+private:
+  std::shared_ptr<node_arena> arena_;
+};
+
+/// A node manager of which nodes are created in one arena, contiguous in the
+/// order of creation, instead of by separate make_shared(), so that nodes
+/// share no cacheline and are packed in few pages. Scans of nodes, e.g. by
+/// heartbeat and ranking, walk memory linearly only if nodes are created in
+/// id order, since ready_go() sorts them by id. Items are still shared
+/// pointers. Copies of a node manager share the arena.
+template <typename NodeType,
+          typename ContainerType = std::vector<std::shared_ptr<NodeType>>>
+class arena_node_manager : public node_manager_base<NodeType, ContainerType> {
+  using base_t = node_manager_base<NodeType, ContainerType>;
+
+public:
+  using node_t     = typename base_t::node_t;
+  using node_ptr_t = typename base_t::node_ptr_t;
+
+public:
+  explicit arena_node_manager(size_t chunk_node_cnt = 256)
+      : arena_(std::make_shared<node_arena>(chunk_node_cnt)) {}
+
+  template <typename... Args>
+  node_ptr_t new_node(Args&&... args) const {
+    return std::allocate_shared<node_t>(
+        node_arena_allocator<node_t>(arena_), std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  node_ptr_t new_back(Args&&... args) {
+    auto new_node_ptr = new_node(std::forward<Args>(args)...);
+    base_t::push_back(new_node_ptr);
+    return new_node_ptr;
+  }
+
+  const node_arena& arena() const { return *arena_; }
+
+private:
+  std::shared_ptr<node_arena> arena_;
+};
+
+}  // namespace maglev
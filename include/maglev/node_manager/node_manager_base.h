@@ -16,12 +16,16 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "maglev/util/aligned_new.h"
 #include "maglev/util/to_str.h"
+#include "maglev/util/type_traits.h"
 
 namespace maglev {
 
@@ -40,21 +44,42 @@ public:
   static_assert((std::is_same<item_t, node_ptr_t>::value),
                 "value in ContainerType must be same type as node_ptr_t");
 
+  static constexpr size_t npos = size_t(-1);
+
+  // Difference of a full node list from nodes of this node manager.
+  struct membership_diff_t {
+    std::vector<item_t>    add;     // nodes of new ids
+    std::vector<node_id_t> remove;  // ids not in the new list
+    // (id, new weight) of nodes of which weight changed, for weighted nodes
+    std::vector<std::pair<node_id_t, unsigned int>> reweight;
+
+    bool empty() const {
+      return add.empty() && remove.empty() && reweight.empty();
+    }
+  };
+
 public:
   // Call this after all nodes have pushed into node_manager.
   virtual void ready_go() {
     if (!is_sorted()) sort();
+    build_id_index();
   }
 
   bool is_sorted() const {
     return std::is_sorted(base_t::begin(), base_t::end(), item_cmp);
   }
 
-  void sort() { std::sort(base_t::begin(), base_t::end(), item_cmp); }
+  void sort() {
+    std::sort(base_t::begin(), base_t::end(), item_cmp);
+    id_index_.clear();
+  }
 
+  // Nodes of over-aligned stats, e.g. sharded_counter, are aligned, which
+  // make_shared of C++14 does not.
   template <typename... Args>
   static node_ptr_t new_node(Args&&... args) {
-    return std::make_shared<node_t>(std::forward<Args>(args)...);
+    return std::allocate_shared<node_t>(aligned_allocator<node_t>(),
+                                        std::forward<Args>(args)...);
   }
 
   template <typename... Args>
@@ -64,6 +89,17 @@ public:
     return new_node_ptr;
   }
 
+  // Count of virtual nodes of each node in the slot table of a hasher, 1 by
+  // default. A node of k vnodes gets slots by k permutations, but is still
+  // one node object, so stats, heartbeat ranking and bans are of the
+  // physical node, and picks return it. Set it before build.
+  void set_vnode_cnt(size_t k) {
+    assert(k > 0);
+    vnode_cnt_ = k > 0 ? k : 1;
+  }
+
+  size_t vnode_cnt() const { return vnode_cnt_; }
+
   void push_back(const item_t& i) {
     assert(i);
     base_t::push_back(i);
@@ -71,13 +107,110 @@ public:
 
   // Returns node pointer if found, or nullptr if not.
   node_ptr_t find_by_node_id(const node_id_t& id) const {
+    size_t idx = find_idx_by_node_id(id);
+    return idx != npos ? (*this)[idx] : nullptr;
+  }
+
+  // Returns index of node if found, or npos if not. It is O(1) by the id
+  // index built in ready_go(), and a miss of the index is checked by a binary
+  // search, so nodes replaced since then, e.g. by pop_back() and new_back(),
+  // are still found. Without the index, it is a binary search.
+  size_t find_idx_by_node_id(const node_id_t& id) const {
+    return find_idx_by_node_id(id, hash_id(id));
+  }
+
+  // As above, with h as id_hash() of a node of id.
+  size_t find_idx_by_node_id(const node_id_t& id, size_t h) const {
+    if (has_id_index()) {
+      size_t mask = id_index_.size() - 1;
+      for (size_t i = h & mask;; i = (i + 1) & mask) {
+        std::uint32_t v = id_index_[i];
+        if (v == 0) break;
+        const auto& n = (*this)[v - 1];
+        if (n->id_hash() == h && n->id() == id) return v - 1;
+      }
+    }
     auto it = std::lower_bound(base_t::begin(),
                                base_t::end(),
                                id,
                                [](const item_t& item, const node_id_t& id) {
                                  return item->id() < id;
                                });
-    return it != base_t::end() && (*it)->id() == id ? *it : nullptr;
+    return it != base_t::end() && (*it)->id() == id ? it - base_t::begin()
+                                                    : npos;
+  }
+
+  // Whether the id index is probed, i.e. there are as many nodes as at
+  // ready_go(). A hit is of the node of the id, since ids are compared.
+  bool has_id_index() const {
+    return !id_index_.empty() && id_index_size_ == base_t::size();
+  }
+
+  // Diff a full node list, e.g. pushed by service discovery, against nodes
+  // of this node manager. It is O(N) by the id index, so call ready_go()
+  // before. Ids in the list must be unique.
+  membership_diff_t diff_membership(const std::vector<item_t>& new_list) const {
+    membership_diff_t diff;
+    std::vector<bool> kept(base_t::size(), false);
+    for (const auto& n : new_list) {
+      assert(n);
+      size_t idx = find_idx_by_node_id(n->id(), n->id_hash());
+      if (idx == npos) {
+        diff.add.push_back(n);
+        continue;
+      }
+      kept[idx] = true;
+      diff_weight((*this)[idx], n, diff, is_weighted_t<node_t>{});
+    }
+    for (size_t i = 0; i < base_t::size(); ++i) {
+      if (!kept[i]) diff.remove.push_back((*this)[i]->id());
+    }
+    return diff;
+  }
+
+  // Make nodes the same as new_list. Nodes of ids already here are kept, so
+  // their stats are kept too, only weights are copied from new_list. Added
+  // nodes are merged in sorted order, then ready_go() is called. Returns
+  // false and changes nothing if the membership and weights are the same.
+  bool apply_membership(const std::vector<item_t>& new_list) {
+    return apply_membership_diff(diff_membership(new_list));
+  }
+
+  // Apply a diff from diff_membership() of the current nodes.
+  bool apply_membership_diff(const membership_diff_t& diff) {
+    if (diff.empty()) return false;
+    for (const auto& i : diff.reweight) {
+      size_t idx = find_idx_by_node_id(i.first);
+      if (idx == npos) continue;
+      set_weight((*this)[idx], i.second, is_weighted_t<node_t>{});
+    }
+    if (diff.add.empty() && diff.remove.empty()) {
+      ready_go();  // e.g. for weights
+      return true;
+    }
+    std::vector<item_t> nodes;
+    nodes.reserve(base_t::size() + diff.add.size());
+    if (diff.remove.empty()) {
+      nodes.assign(base_t::begin(), base_t::end());
+    } else {
+      std::vector<bool> removed(base_t::size(), false);
+      for (const auto& id : diff.remove) {
+        size_t idx = find_idx_by_node_id(id);
+        if (idx != npos) removed[idx] = true;
+      }
+      for (size_t i = 0; i < base_t::size(); ++i) {
+        if (!removed[i]) nodes.push_back((*this)[i]);
+      }
+    }
+    // nodes kept are still sorted, only added ones need sorting
+    size_t mid = nodes.size();
+    nodes.insert(nodes.end(), diff.add.begin(), diff.add.end());
+    std::sort(nodes.begin() + mid, nodes.end(), item_cmp);
+    std::inplace_merge(
+        nodes.begin(), nodes.begin() + mid, nodes.end(), item_cmp);
+    base_t::assign(nodes.begin(), nodes.end());
+    ready_go();
+    return true;
   }
 
   node_map_t make_node_map() const {
@@ -97,8 +230,58 @@ public:
   }
 
   virtual std::string to_str() const { return maglev::to_str(*this); }
+
+private:
+  static void diff_weight(const item_t&      cur,
+                          const item_t&      n,
+                          membership_diff_t& diff,
+                          std::true_type) {
+    if (cur->weight() != n->weight()) {
+      diff.reweight.emplace_back(cur->id(), n->weight());
+    }
+  }
+
+  static void diff_weight(const item_t&      cur,
+                          const item_t&      n,
+                          membership_diff_t& diff,
+                          std::false_type) {}
+
+  static void set_weight(const item_t& n, unsigned int w, std::true_type) {
+    n->set_weight(w);
+  }
+
+  static void set_weight(const item_t& n, unsigned int w, std::false_type) {}
+
+  static size_t hash_id(const node_id_t& id) {
+    return typename node_t::hash_t{}(id);
+  }
+
+  // Open addressing table of node index + 1, 0 for empty, at least twice as
+  // large as nodes, probed linearly from id_hash(). Ids are compared only if
+  // cached id_hash() are equal.
+  void build_id_index() {
+    size_t n = base_t::size();
+    assert(n < size_t(UINT32_MAX));
+    size_t cap = 4;
+    while (cap < n * 2) cap <<= 1;
+    id_index_.assign(cap, 0);
+    id_index_size_ = n;
+    for (size_t idx = 0; idx < n; ++idx) {
+      size_t i = (*this)[idx]->id_hash() & (cap - 1);
+      while (id_index_[i] != 0) i = (i + 1) & (cap - 1);
+      id_index_[i] = std::uint32_t(idx + 1);
+    }
+  }
+
+private:
+  std::vector<std::uint32_t> id_index_;
+  size_t                     id_index_size_ = 0;
+  size_t                     vnode_cnt_     = 1;
 };
 
+template <typename NodeType, typename ContainerType>
+constexpr size_t node_manager_base<NodeType, ContainerType>::npos;
+
 template <typename Char,
           typename Traits,
           typename NodeType,
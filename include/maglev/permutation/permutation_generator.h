@@ -30,7 +30,7 @@ namespace maglev {
 class permutation_generator {
 public:
   using hash64_t = unsigned long long;
-  using num_t    = unsigned int;
+  using num_t    = unsigned long long;
 
 public:
   permutation_generator(size_t n) : n_(n), offset_(0), step_(1) { assert_n(); }
@@ -70,7 +70,9 @@ public:
     num_t ret = offset_;
     assert(ret >= 0);
     assert(ret < n_);
-    offset_ = (offset_ + step_) % n_;
+    // Same as (offset_ + step_) % n_ since both are less than n_, but
+    // without division and overflow.
+    offset_ = offset_ >= n_ - step_ ? offset_ - (n_ - step_) : offset_ + step_;
     return ret;
   }
 
@@ -44,6 +44,12 @@ public:
 
   void clear() noexcept { set(value_t{0}); }
 
+  // Set to v and return the old value, atomically, so that no increment in
+  // other threads is lost between a get() and a set().
+  value_t exchange(value_t v) noexcept {
+    return cnt_.exchange(v, std::memory_order_relaxed);
+  }
+
   operator value_t() const noexcept { return get(); }
 
   atomic_counter& operator=(value_t v) noexcept {
@@ -18,6 +18,8 @@
 
 #include "maglev/stats/atomic_counter.h"
 #include "maglev/stats/cycle_array.h"
+#include "maglev/stats/outcome_record.h"
+#include "maglev/stats/sharded_counter.h"
 #include "maglev/stats/sliding_window.h"
 #include "maglev/util/to_str.h"
 
@@ -69,11 +71,15 @@ std::basic_ostream<Char, Traits>& operator<<(
   return os;
 }
 
-/// To record a node's load.
-template <typename PointValueType = unsigned long long, size_t LoadSeqSize = 64>
+/// To record a node's load. LoadDataType is the sliding window of load, whose
+/// counter of now could be a sharded_counter for hot loads, see
+/// sharded_load_stats.
+template <typename PointValueType = unsigned long long,
+          size_t LoadSeqSize      = 64,
+          typename LoadDataType   = sliding_window<PointValueType, LoadSeqSize>>
 class load_stats {
 public:
-  using load_data_t     = sliding_window<PointValueType, LoadSeqSize>;
+  using load_data_t     = LoadDataType;
   using load_value_t    = typename load_data_t::point_value_t;
   using heartbeat_cnt_t = typename load_data_t::heartbeat_cnt_t;
 
@@ -111,23 +117,36 @@ public:
   }
 
 private:
-  load_data_t load_;
-  int         load_rank_ = 0;
+  load_data_t         load_;
+  atomic_counter<int> load_rank_;  // set by heartbeat, read by live checks
 };
 
 template <typename Char,
           typename Traits,
           typename PointValueType,
-          size_t LoadSeqSize>
+          size_t LoadSeqSize,
+          typename LoadDataType>
 std::basic_ostream<Char, Traits>& operator<<(
-    std::basic_ostream<Char, Traits>&              os,
-    const load_stats<PointValueType, LoadSeqSize>& s) {
+    std::basic_ostream<Char, Traits>&                            os,
+    const load_stats<PointValueType, LoadSeqSize, LoadDataType>& s) {
   os << "[";
   s.output_stats(os);
   os << "]";
   return os;
 }
 
+/// Load stats of which increments of now are spread over per thread shards,
+/// for nodes or global load taking increments from many threads.
+template <typename PointValueType = unsigned long long,
+          size_t LoadSeqSize      = 64,
+          size_t ShardSize        = 16>
+using sharded_load_stats = load_stats<
+    PointValueType,
+    LoadSeqSize,
+    sliding_window<PointValueType,
+                   LoadSeqSize,
+                   sharded_counter<PointValueType, ShardSize>>>;
+
 /// To record info about whether a node is banned.
 template <typename LoadStatsBase>
 class ban_wrapper : public LoadStatsBase {
@@ -156,8 +175,8 @@ public:
   }
 
 private:
-  ban_cnt_t  consecutive_ban_cnt_ = 0;
-  ban_time_t last_ban_time_       = 0;
+  atomic_counter<ban_cnt_t>  consecutive_ban_cnt_;
+  atomic_counter<ban_time_t> last_ban_time_;
 };
 
 template <typename Char, typename Traits, typename LoadStatsBase>
@@ -169,7 +188,9 @@ std::basic_ostream<Char, Traits>& operator<<(
   return os;
 }
 
-/// To describe a server's load in RPC scene.
+/// To describe a server's load in RPC scene. Counts of now of query, error,
+/// fatal and latency are kept in one outcome_record, and read by the sliding
+/// windows through field counters.
 template <typename LoadStatsBase  = load_stats<>,
           typename QueryCntType   = unsigned int,
           typename LatencyCntType = unsigned long long,
@@ -183,10 +204,46 @@ public:
   using fatal_cnt_t   = QueryCntType;
   using latency_cnt_t = LatencyCntType;
 
-  using query_data_t   = sliding_window<query_cnt_t, SeqSize>;
-  using error_data_t   = sliding_window<error_cnt_t, SeqSize>;
-  using fatal_data_t   = sliding_window<fatal_cnt_t, SeqSize>;
-  using latency_data_t = sliding_window<latency_cnt_t, SeqSize>;
+  using outcome_record_t = outcome_record<query_cnt_t, latency_cnt_t>;
+
+  using query_data_t =
+      sliding_window<query_cnt_t, SeqSize, field_counter<query_cnt_t>>;
+  using error_data_t =
+      sliding_window<error_cnt_t, SeqSize, field_counter<error_cnt_t>>;
+  using fatal_data_t =
+      sliding_window<fatal_cnt_t, SeqSize, field_counter<fatal_cnt_t>>;
+  using latency_data_t =
+      sliding_window<latency_cnt_t, SeqSize, field_counter<latency_cnt_t>>;
+
+  server_load_stats_wrapper() { bind_record(); }
+  server_load_stats_wrapper(const server_load_stats_wrapper& r)
+      : base_t(r),
+        record_(r.record_),
+        query_(r.query_),
+        error_(r.error_),
+        fatal_(r.fatal_),
+        latency_(r.latency_),
+        query_rank_(r.query_rank_),
+        error_rank_(r.error_rank_),
+        fatal_rank_(r.fatal_rank_),
+        latency_rank_(r.latency_rank_) {
+    bind_record();
+  }
+
+  server_load_stats_wrapper& operator=(const server_load_stats_wrapper& r) {
+    base_t::operator=(r);
+    record_       = r.record_;
+    query_        = r.query_;
+    error_        = r.error_;
+    fatal_        = r.fatal_;
+    latency_      = r.latency_;
+    query_rank_   = r.query_rank_;
+    error_rank_   = r.error_rank_;
+    fatal_rank_   = r.fatal_rank_;
+    latency_rank_ = r.latency_rank_;
+    bind_record();
+    return *this;
+  }
 
   // A load_stats must have a heartbeat() method.
   void heartbeat() {
@@ -257,12 +314,11 @@ public:
                         error_cnt_t   e,
                         fatal_cnt_t   f,
                         latency_cnt_t l) {
-    query_.incr(q);
-    if (e) error_.incr(e);
-    if (f) fatal_.incr(f);
-    latency_.incr(l);
+    record_.incr(q, e, f, l);
   }
 
+  const outcome_record_t& record() const { return record_; }
+
   virtual std::string to_str() const override { return maglev::to_str(*this); }
 
   template <typename Char, typename Traits>
@@ -288,15 +344,24 @@ public:
   }
 
 private:
-  query_data_t   query_;
-  error_data_t   error_;
-  fatal_data_t   fatal_;
-  latency_data_t latency_;
-
-  int query_rank_   = 0;
-  int error_rank_   = 0;
-  int fatal_rank_   = 0;
-  int latency_rank_ = 0;
+  void bind_record() {
+    query_.now_counter().bind(&record_.query);
+    error_.now_counter().bind(&record_.error);
+    fatal_.now_counter().bind(&record_.fatal);
+    latency_.now_counter().bind(&record_.latency);
+  }
+
+private:
+  outcome_record_t record_;
+  query_data_t     query_;
+  error_data_t     error_;
+  fatal_data_t     fatal_;
+  latency_data_t   latency_;
+
+  atomic_counter<int> query_rank_;
+  atomic_counter<int> error_rank_;
+  atomic_counter<int> fatal_rank_;
+  atomic_counter<int> latency_rank_;
 };
 
 template <typename Char,
@@ -377,4 +442,46 @@ std::basic_ostream<Char, Traits>& operator<<(
   return os;
 }
 
+/// To record a node's in-flight queries, i.e. picked but not finished, for
+/// bounded_load_balance_strategy. Callers incr when a query is sent to the
+/// node and decr when it finishes, on both the node and the global stats.
+template <typename LoadStatsBase = load_stats<>, typename InflightCntType = int>
+class inflight_wrapper : public LoadStatsBase {
+  using base_t = LoadStatsBase;
+
+public:
+  using inflight_cnt_t = InflightCntType;
+
+  inflight_cnt_t inflight() const { return inflight_.get(); }
+
+  void incr_inflight() { ++inflight_; }
+  void decr_inflight() { --inflight_; }
+
+  virtual std::string to_str() const override { return maglev::to_str(*this); }
+
+  template <typename Char, typename Traits>
+  std::basic_ostream<Char, Traits>& output_stats(
+      std::basic_ostream<Char, Traits>& os) const {
+    base_t::output_stats(os);
+    os << ",in:" << inflight();
+    return os;
+  }
+
+private:
+  atomic_counter<inflight_cnt_t> inflight_;
+};
+
+template <typename Char,
+          typename Traits,
+          typename LoadStatsBase,
+          typename InflightCntType>
+std::basic_ostream<Char, Traits>& operator<<(
+    std::basic_ostream<Char, Traits>&                       os,
+    const inflight_wrapper<LoadStatsBase, InflightCntType>& s) {
+  os << "[";
+  s.output_stats(os);
+  os << "]";
+  return os;
+}
+
 }  // namespace maglev
@@ -37,12 +37,12 @@ public:
 
   node_meta_t&       node_meta() { return *static_cast<node_meta_t*>(this); }
   const node_meta_t& node_meta() const {
-    return *static_cast<node_meta_t>(this);
+    return *static_cast<const node_meta_t*>(this);
   }
 
   load_stats_t&       load_stats() { return *static_cast<load_stats_t*>(this); }
   const load_stats_t& load_stats() const {
-    return *static_cast<load_stats_t>(this);
+    return *static_cast<const load_stats_t*>(this);
   }
 
   virtual std::string to_str() const override { return maglev::to_str(*this); }
@@ -0,0 +1,129 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <type_traits>
+
+#include "maglev/util/aligned_new.h"
+
+namespace maglev {
+
+/// Counts of queries, errors, fatals and the latency sum of a heartbeat period
+/// in one cacheline, so that recording a query outcome touches one cacheline
+/// instead of one per count, also when allocated by new.
+template <typename QueryCntType   = unsigned int,
+          typename LatencyCntType = unsigned long long>
+struct alignas(64) outcome_record : aligned_new<64> {
+  using query_cnt_t   = QueryCntType;
+  using latency_cnt_t = LatencyCntType;
+
+  std::atomic<query_cnt_t>   query{0};
+  std::atomic<query_cnt_t>   error{0};
+  std::atomic<query_cnt_t>   fatal{0};
+  std::atomic<latency_cnt_t> latency{0};
+
+  outcome_record() = default;
+  outcome_record(const outcome_record& r) { *this = r; }
+
+  outcome_record& operator=(const outcome_record& r) {
+    query.store(r.query.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    error.store(r.error.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    fatal.store(r.fatal.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    latency.store(r.latency.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+    return *this;
+  }
+
+  // Errors and fatals are rare, so a query costs two atomic adds on the same
+  // cacheline mostly.
+  void incr(query_cnt_t q, query_cnt_t e, query_cnt_t f, latency_cnt_t l) {
+    query.fetch_add(q, std::memory_order_relaxed);
+    if (e) error.fetch_add(e, std::memory_order_relaxed);
+    if (f) fatal.fetch_add(f, std::memory_order_relaxed);
+    latency.fetch_add(l, std::memory_order_relaxed);
+  }
+};
+
+/// Counter on a field of a shared record, e.g. an outcome_record, so that
+/// counters of several sliding windows share one cacheline. It must be bound
+/// to the field by bind() before use, and a copy is bound to the same field.
+/// Same interface as atomic_counter.
+template <typename IntType = int>
+class field_counter {
+  static_assert(std::is_integral<IntType>::value &&
+                    !std::is_same<IntType, bool>::value,
+                "field_counter should contain a integral type");
+
+public:
+  using value_t   = IntType;
+  using counter_t = typename std::atomic<value_t>;
+
+public:
+  field_counter(value_t v = 0, value_t u = 1) : unit_(u) { assert(v == 0); }
+
+  void bind(counter_t* c) noexcept { cnt_ = c; }
+
+  // unit() used as the operand for operator ++ and --
+  value_t unit() const { return unit_; }
+  void    set_unit(value_t u) { unit_ = u; }
+
+  value_t get() const noexcept { return cnt_->load(std::memory_order_relaxed); }
+
+  void set(value_t v) noexcept { cnt_->store(v, std::memory_order_relaxed); }
+
+  void clear() noexcept { set(value_t{0}); }
+
+  // Set to v and return the old value, atomically.
+  value_t exchange(value_t v) noexcept {
+    return cnt_->exchange(v, std::memory_order_relaxed);
+  }
+
+  operator value_t() const noexcept { return get(); }
+
+  field_counter& operator=(value_t v) noexcept {
+    set(v);
+    return *this;
+  }
+  field_counter& operator+=(value_t v) noexcept {
+    cnt_->fetch_add(v, std::memory_order_relaxed);
+    return *this;
+  }
+  field_counter& operator-=(value_t v) noexcept {
+    cnt_->fetch_sub(v, std::memory_order_relaxed);
+    return *this;
+  }
+
+  // Delete suffix increment and decrement
+  value_t operator++(int) noexcept = delete;
+  value_t operator--(int) noexcept = delete;
+
+  // Prefix increment and decrement
+  field_counter& operator++() noexcept { return *this += unit(); }
+  field_counter& operator--() noexcept { return *this -= unit(); }
+
+  value_t operator+(value_t v) const noexcept { return get() + v; }
+  value_t operator-(value_t v) const noexcept { return get() - v; }
+
+private:
+  counter_t* cnt_ = nullptr;
+  value_t    unit_{1};
+};
+
+}  // namespace maglev
@@ -0,0 +1,148 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+#include "maglev/util/aligned_new.h"
+
+namespace maglev {
+
+/// Index of the calling thread, given in order of the first call of each
+/// thread, used to spread threads over shards.
+inline size_t thread_shard_index() {
+  static std::atomic<size_t> next{0};
+  static thread_local size_t idx = next.fetch_add(1, std::memory_order_relaxed);
+  return idx;
+}
+
+/// Integral counter of cacheline padded shards, each thread increments its own
+/// shard, so that threads do not contend on one cacheline. A read sums all
+/// shards, so reads cost more than of atomic_counter, use it for counters of
+/// many increments and few reads, such as "now" of a hot sliding_window.
+/// Same interface as atomic_counter. Shards stay on their own cachelines also
+/// when the counter is allocated by new, see aligned_new.
+template <typename IntType = int, size_t ShardSize = 16>
+class sharded_counter : public aligned_new<64> {
+  static_assert(std::is_integral<IntType>::value &&
+                    !std::is_same<IntType, bool>::value,
+                "sharded_counter should contain a integral type");
+  static_assert(ShardSize > 0, "sharded_counter should have shards");
+
+public:
+  using value_t = IntType;
+
+  static constexpr size_t cacheline_size = 64;
+
+  struct alignas(cacheline_size) shard_t {
+    std::atomic<value_t> cnt{0};
+  };
+
+public:
+  sharded_counter(value_t v = 0, value_t u = 1) : unit_(u) { set(v); }
+  sharded_counter(const sharded_counter& r) : unit_(r.unit()) { set(r.get()); }
+
+  static constexpr size_t shard_size() { return ShardSize; }
+
+  // unit() used as the operand for operator ++ and --
+  value_t unit() const { return unit_; }
+  void    set_unit(value_t u) { unit_ = u; }
+
+  // Sum of all shards, increments in other threads may or may not be seen.
+  value_t get() const noexcept {
+    value_t v{0};
+    for (const auto& s : shards_) v += s.cnt.load(std::memory_order_relaxed);
+    return v;
+  }
+
+  // Not atomic with increments in other threads.
+  void set(value_t v) noexcept {
+    for (auto& s : shards_) s.cnt.store(value_t{0}, std::memory_order_relaxed);
+    shards_[0].cnt.store(v, std::memory_order_relaxed);
+  }
+
+  void clear() noexcept { set(value_t{0}); }
+
+  // Set to v and return the old value. Each shard is taken atomically, so no
+  // increment in other threads is lost, it is in either the old value or the
+  // new one.
+  value_t exchange(value_t v) noexcept {
+    value_t old{0};
+    for (auto& s : shards_) {
+      old += s.cnt.exchange(value_t{0}, std::memory_order_relaxed);
+    }
+    if (v != value_t{0}) fetch_add(v);
+    return old;
+  }
+
+  operator value_t() const noexcept { return get(); }
+
+  sharded_counter& operator=(value_t v) noexcept {
+    set(v);
+    return *this;
+  }
+  sharded_counter& operator=(const sharded_counter& r) noexcept {
+    set(r.get());
+    unit_ = r.unit();
+    return *this;
+  }
+  sharded_counter& operator+=(value_t v) noexcept {
+    fetch_add(v);
+    return *this;
+  }
+  sharded_counter& operator-=(value_t v) noexcept {
+    fetch_sub(v);
+    return *this;
+  }
+
+  // Delete suffix increment and decrement
+  value_t operator++(int) noexcept = delete;
+  value_t operator--(int) noexcept = delete;
+
+  // Prefix increment and decrement
+  sharded_counter& operator++() noexcept {
+    fetch_add(unit());
+    return *this;
+  }
+  sharded_counter& operator--() noexcept {
+    fetch_sub(unit());
+    return *this;
+  }
+
+  value_t operator+(value_t v) const noexcept { return get() + v; }
+  value_t operator-(value_t v) const noexcept { return get() - v; }
+
+protected:
+  shard_t& local_shard() noexcept {
+    return shards_[thread_shard_index() % ShardSize];
+  }
+
+  // Return the old value of the shard of this thread, not of the counter.
+  value_t fetch_add(value_t delta) noexcept {
+    return local_shard().cnt.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  value_t fetch_sub(value_t delta) noexcept {
+    return local_shard().cnt.fetch_sub(delta, std::memory_order_relaxed);
+  }
+
+private:
+  shard_t shards_[ShardSize];
+  value_t unit_{1};
+};
+
+}  // namespace maglev
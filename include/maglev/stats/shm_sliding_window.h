@@ -0,0 +1,211 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "maglev/stats/load_stats.h"
+#include "maglev/util/aligned_new.h"
+#include "maglev/util/hash.h"
+#include "maglev/util/shm_region.h"
+
+namespace maglev {
+
+/// Data of a sliding window in a shm_region block, all zero when created.
+/// It is also allocated by a window not bound yet, so new of it is aligned.
+template <typename PointValueType, size_t SeqSize>
+struct shm_window_block : aligned_new<64> {
+  using point_value_t = PointValueType;
+  using atomic_t      = std::atomic<point_value_t>;
+
+  alignas(64) atomic_t now;
+  alignas(64) atomic_t sum;
+  std::atomic<size_t> heartbeat_cnt;
+  atomic_t            seq[SeqSize];
+};
+
+/// A sliding window as sliding_window, of which data are in a shm_region, so
+/// that processes bound to the same key share one window: increments of all
+/// processes go to the same now, and reads see the total.
+///
+/// heartbeat() advances the window only in the process holding the lease of
+/// the region, in others it is a no-op, so call region.try_lease() before
+/// heartbeat in every process.
+///
+/// Until bound by bind(), a window has a local block of its own and works as
+/// a sliding_window of this process only, e.g. of a node added by
+/// apply_membership() and not bound yet. Data of the local block are dropped
+/// when bound.
+template <typename PointValueType = unsigned long long, size_t SeqSize = 64>
+class shm_sliding_window {
+  static_assert(std::is_integral<PointValueType>::value,
+                "shm_sliding_window should contain a integral type");
+
+public:
+  using point_value_t   = PointValueType;
+  using heartbeat_cnt_t = size_t;
+  using block_t         = shm_window_block<point_value_t, SeqSize>;
+
+public:
+  shm_sliding_window() : local_(new block_t()), block_(local_.get()) {}
+
+  // A copy of a bound window is bound to the same block, a copy of an
+  // unbound one has a local block of the same data.
+  shm_sliding_window(const shm_sliding_window& r)
+      : region_(r.region_), block_(r.block_), unit_(r.unit_) {
+    if (r.is_bound()) return;
+    local_.reset(new block_t());
+    block_ = local_.get();
+    copy_block(*r.block_, *block_);
+  }
+
+  shm_sliding_window& operator=(const shm_sliding_window& r) {
+    if (this != &r) {
+      shm_sliding_window t(r);
+      std::swap(region_, t.region_);
+      std::swap(local_, t.local_);
+      std::swap(block_, t.block_);
+      unit_ = t.unit_;
+    }
+    return *this;
+  }
+
+  // Bind to the block of key in region, return false and keep the block in
+  // use if region is full, or its blocks are smaller than block_t.
+  bool bind(shm_region& region, shm_region::key_t key) {
+    block_t* b = region.block_as<block_t>(key);
+    if (b == nullptr) return false;
+    region_ = &region;
+    block_  = b;
+    local_.reset();
+    return true;
+  }
+
+  bool is_bound() const { return region_ != nullptr; }
+
+  static constexpr size_t seq_size() { return SeqSize; }
+  point_value_t           unit() const { return unit_; }
+  void                    set_unit(point_value_t u) { unit_ = u; }
+
+  // Incr point of now by one unit.
+  void incr() { incr(unit_); }
+  // Incr load by specific value.
+  void incr(point_value_t delta) {
+    block_->now.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  // Push now to seq, reset now to zero, drop oldest one in seq, only if this
+  // process holds the lease of the region, or the window is not bound.
+  void heartbeat() {
+    if (region_ && !region_->lease_held()) return;
+    size_t        cnt = block_->heartbeat_cnt.load(std::memory_order_relaxed);
+    atomic_t&     p   = block_->seq[cnt % SeqSize];
+    point_value_t v   = block_->now.exchange(0, std::memory_order_relaxed);
+    point_value_t old = p.exchange(v, std::memory_order_relaxed);
+    block_->sum.fetch_add(v - old, std::memory_order_relaxed);
+    block_->heartbeat_cnt.store(cnt + 1, std::memory_order_release);
+  }
+
+  // Now is an incomplete point
+  point_value_t now() const { return load(block_->now); }
+  // Last is a complete point
+  point_value_t last() const {
+    size_t cnt = heartbeat_cnt();
+    return load(block_->seq[(cnt + SeqSize - 1) % SeqSize]);
+  }
+  // Sum of all complete points in this window, NOT include now!
+  point_value_t sum() const { return load(block_->sum); }
+
+  // Average of data in seq, not include data of now.
+  double avg() const {
+    heartbeat_cnt_t cnt = heartbeat_cnt();
+    return double(sum()) /
+           double(cnt < seq_size() && cnt > 0 ? cnt : seq_size());
+  }
+
+  heartbeat_cnt_t heartbeat_cnt() const {
+    return block_->heartbeat_cnt.load(std::memory_order_acquire);
+  }
+
+private:
+  using atomic_t = typename block_t::atomic_t;
+
+  static point_value_t load(const atomic_t& a) {
+    return a.load(std::memory_order_relaxed);
+  }
+
+  static void copy_block(const block_t& from, block_t& to) {
+    to.now.store(load(from.now), std::memory_order_relaxed);
+    to.sum.store(load(from.sum), std::memory_order_relaxed);
+    to.heartbeat_cnt.store(
+        from.heartbeat_cnt.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    for (size_t i = 0; i < SeqSize; ++i) {
+      to.seq[i].store(load(from.seq[i]), std::memory_order_relaxed);
+    }
+  }
+
+private:
+  shm_region*              region_ = nullptr;  // null until bound
+  std::unique_ptr<block_t> local_;             // block until bound
+  block_t*                 block_  = nullptr;
+  point_value_t            unit_   = 1;
+};
+
+/// Load stats of which the load window is shared by processes in a
+/// shm_region, see bind_shm_load_stats().
+template <typename PointValueType = unsigned long long, size_t LoadSeqSize = 64>
+using shm_load_stats =
+    load_stats<PointValueType,
+               LoadSeqSize,
+               shm_sliding_window<PointValueType, LoadSeqSize>>;
+
+/// Key of a load window in a shm_region, of a node by its id_hash(), in
+/// namespace ns, see bind_shm_load_stats().
+inline shm_region::key_t shm_load_stats_key(shm_region::key_t k,
+                                            shm_region::key_t ns = 0) {
+  return ns == 0 ? k : maglev_int_hash<shm_region::key_t>{}(k ^ ns);
+}
+
+/// Key of the global load window in namespace ns.
+inline shm_region::key_t shm_global_load_key(shm_region::key_t ns = 0) {
+  return shm_load_stats_key(0x676c6f62616cULL, ns);  // "global"
+}
+
+/// Bind load windows of all nodes of a balancer and its global load to region,
+/// nodes by id_hash(). Windows of nodes added later are local until bound, so
+/// call it again after membership changes, nodes bound are bound again to the
+/// same blocks. Return false if region is full, or its blocks are too small.
+///
+/// Windows are keyed by node ids, so balancers bound to a region share the
+/// windows of nodes of the same id, and the global window. Processes of one
+/// service should share them, but bind balancers of different services or
+/// node sets to their own regions, or to different namespaces ns.
+template <typename BalancerType>
+bool bind_shm_load_stats(BalancerType&     b,
+                         shm_region&       region,
+                         shm_region::key_t ns = 0) {
+  bool ok = b.global_load().load().bind(region, shm_global_load_key(ns));
+  for (const auto& n : b.node_manager()) {
+    ok = n->load().bind(region, shm_load_stats_key(n->id_hash(), ns)) && ok;
+  }
+  return ok;
+}
+
+}  // namespace maglev
@@ -23,6 +23,10 @@ namespace maglev {
 /// and a sequence generator. Contains a integer point counter, called "now".
 /// Each time a `heartbeat()` it will generate a integer, make a copy of "now"
 /// and push it into window, then clear "now".
+///
+/// Reads are atomic, so that they may run in other threads than heartbeat(),
+/// e.g. live checks of picks, though a read of several fields, as avg(), may
+/// see them of two heartbeats. Heartbeats must not run concurrently.
 template <typename PointValueType   = unsigned long long,
           size_t SeqSize            = 64,
           typename CounterType      = atomic_counter<PointValueType>,
@@ -36,7 +40,7 @@ public:
   using heartbeat_cnt_t = HeartbeatCntType;
 
 public:
-  sliding_window() : now_(0), sum_(0), heartbeat_cnt_(0) {}
+  sliding_window() : now_(0), sum_(0), last_(0), heartbeat_cnt_(0) {}
 
   static constexpr size_t seq_size() { return SeqSize; }
   point_value_t           unit() const { return now_.unit(); }
@@ -48,35 +52,41 @@ public:
   void incr(point_value_t delta) { now_ += delta; }
 
   // Push now to seq, reset now to zero, drop oldest one in seq.
+  // Now is taken and reset at once, concurrent increments go to next point.
   void heartbeat() {
-    sum_ += now_ - seq_.curr_item();
-    seq_.push(now_);
-    now_.clear();
+    point_value_t v = now_.exchange(point_value_t{0});
+    sum_ += v - seq_.curr_item();
+    seq_.push(v);
+    last_ = v;
     ++heartbeat_cnt_;
   }
 
   // Now is an incomplete point
   point_value_t now() const { return now_; }
   // Last is a complete point
-  point_value_t last() const { return seq_.prev_item(); }
+  point_value_t last() const { return last_; }
   // Sum of all complete points in this window, NOT include now!
   point_value_t sum() const { return sum_; }
 
   // Average of data in seq_, not include data of now.
   double avg() const {
+    heartbeat_cnt_t cnt = heartbeat_cnt();
     return double(sum()) /
-           double(heartbeat_cnt_ < seq_size() && heartbeat_cnt_ > 0
-                      ? heartbeat_cnt_
-                      : seq_size());
+           double(cnt < seq_size() && cnt > 0 ? cnt : seq_size());
   }
 
   heartbeat_cnt_t heartbeat_cnt() const { return heartbeat_cnt_; }
 
+  // Counter of now, e.g. to bind a field_counter to its record.
+  counter_t&       now_counter() { return now_; }
+  const counter_t& now_counter() const { return now_; }
+
 private:
-  counter_t       now_;  // realtime, point of now, incomplete point
-  point_value_t   sum_;  // sum of points in seq_
-  point_seq_t     seq_;  // sequence of history points, all complete points
-  heartbeat_cnt_t heartbeat_cnt_;
+  counter_t                       now_;   // realtime, incomplete point
+  atomic_counter<point_value_t>   sum_;   // sum of points in seq_
+  atomic_counter<point_value_t>   last_;  // last point pushed to seq_
+  point_seq_t                     seq_;   // history points, all complete
+  atomic_counter<heartbeat_cnt_t> heartbeat_cnt_;
 };
 
 }  // namespace maglev
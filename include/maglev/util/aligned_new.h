@@ -0,0 +1,88 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace maglev {
+
+// Allocate size bytes aligned to align, a power of 2. new and std::allocator
+// of C++14 align only to alignof(std::max_align_t), ignoring alignas() of
+// over-aligned types. Free it by aligned_free().
+inline void* aligned_malloc(size_t size, size_t align) {
+  // the block from operator new is kept just before the aligned address
+  void* raw  = ::operator new(size + align + sizeof(void*));
+  auto  addr = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*);
+  addr       = (addr + align - 1) & ~std::uintptr_t(align - 1);
+  reinterpret_cast<void**>(addr)[-1] = raw;
+  return reinterpret_cast<void*>(addr);
+}
+
+inline void aligned_free(void* p) {
+  if (p) ::operator delete(static_cast<void**>(p)[-1]);
+}
+
+/// Base of an over-aligned type, so that new of it is aligned to Align.
+template <size_t Align>
+struct aligned_new {
+  static void* operator new(size_t size) { return aligned_malloc(size, Align); }
+  static void* operator new[](size_t size) {
+    return aligned_malloc(size, Align);
+  }
+  static void operator delete(void* p) { aligned_free(p); }
+  static void operator delete[](void* p) { aligned_free(p); }
+};
+
+/// Allocator aligned to alignof(T), e.g. for std::allocate_shared of a type
+/// of over-aligned members.
+template <typename T>
+class aligned_allocator {
+public:
+  using value_type = T;
+
+public:
+  aligned_allocator() = default;
+
+  template <typename U>
+  aligned_allocator(const aligned_allocator<U>&) {}
+
+  T* allocate(size_t n) {
+    if (alignof(T) <= alignof(std::max_align_t)) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(aligned_malloc(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t) {
+    if (alignof(T) <= alignof(std::max_align_t)) {
+      ::operator delete(p);
+    } else {
+      aligned_free(p);
+    }
+  }
+
+  template <typename U>
+  bool operator==(const aligned_allocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const aligned_allocator<U>&) const {
+    return false;
+  }
+};
+
+}  // namespace maglev
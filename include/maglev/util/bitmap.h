@@ -0,0 +1,59 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <cassert>
+#include <vector>
+
+namespace maglev {
+
+/// A dense bitmap with fixed size, all bits are unset after reset.
+class bitmap {
+public:
+  using word_t = unsigned long long;
+
+  static constexpr size_t word_bits() { return sizeof(word_t) * 8; }
+
+public:
+  bitmap(size_t n = 0) { reset(n); }
+
+  void reset(size_t n) {
+    n_ = n;
+    words_.assign((n + word_bits() - 1) / word_bits(), 0);
+  }
+
+  size_t size() const { return n_; }
+
+  bool test(size_t i) const {
+    assert(i < n_);
+    return (words_[i / word_bits()] >> (i % word_bits())) & 1;
+  }
+
+  void set(size_t i) {
+    assert(i < n_);
+    words_[i / word_bits()] |= word_t(1) << (i % word_bits());
+  }
+
+  void unset(size_t i) {
+    assert(i < n_);
+    words_[i / word_bits()] &= ~(word_t(1) << (i % word_bits()));
+  }
+
+private:
+  size_t              n_ = 0;
+  std::vector<word_t> words_;
+};
+
+}  // namespace maglev
@@ -0,0 +1,193 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "maglev/util/aligned_new.h"
+
+namespace maglev {
+
+/**
+ * Epoch based reclamation for objects read lock-free by many threads and
+ * replaced by writers, e.g. maglev_hasher in maglev_balancer.
+ *
+ * Readers access shared objects within an epoch_guard, which only publishes
+ * the global epoch to a thread local record. Writers unlink an object first,
+ * then retire it, and it is deleted after the global epoch has advanced twice,
+ * when no reader can still hold it. The global epoch advances only if every
+ * reader in a guard has observed the current epoch.
+ */
+class epoch_domain {
+public:
+  using epoch_t = std::uint64_t;
+
+  // Per thread record, never freed but reused after the thread exits. Each is
+  // on its own cacheline, also when allocated by new in C++14.
+  struct alignas(64) record : aligned_new<64> {
+    std::atomic<epoch_t> epoch{0};  // 0 if not in a guard
+    std::atomic<bool>    in_use{false};
+    size_t               nest = 0;  // nested guards, owner thread only
+    record*              next = nullptr;
+  };
+
+public:
+  // Never destroyed, so that it is usable in destructors of static objects.
+  static epoch_domain& global() {
+    static epoch_domain* d = new epoch_domain;
+    return *d;
+  }
+
+  epoch_domain(const epoch_domain&)            = delete;
+  epoch_domain& operator=(const epoch_domain&) = delete;
+
+  void enter() {
+    record* r = local_record();
+    if (r->nest++ > 0) return;
+    r->epoch.store(global_epoch_.load(std::memory_order_acquire),
+                   std::memory_order_relaxed);
+    // Publishing the epoch must be ordered before reading shared pointers.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void leave() {
+    record* r = local_record();
+    assert(r->nest > 0);
+    if (--r->nest > 0) return;
+    r->epoch.store(0, std::memory_order_release);
+  }
+
+  // Delete p after no reader can hold it. p must have been unlinked from
+  // where readers load it.
+  template <typename T>
+  void retire(T* p) {
+    if (!p) return;
+    std::lock_guard<std::mutex> lock(mtx_);
+    retired_.push_back({p,
+                        [](void* x) { delete static_cast<T*>(x); },
+                        global_epoch_.load(std::memory_order_seq_cst)});
+    try_advance();
+    reclaim();
+  }
+
+  // Try to advance the global epoch and delete safe objects, returns number
+  // of objects not deleted yet.
+  size_t collect() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    try_advance();
+    reclaim();
+    return retired_.size();
+  }
+
+  epoch_t epoch() const {
+    return global_epoch_.load(std::memory_order_acquire);
+  }
+
+private:
+  struct retired_t {
+    void* ptr;
+    void (*deleter)(void*);
+    epoch_t epoch;
+  };
+
+  epoch_domain() {}
+
+  record* acquire_record() {
+    record* head = records_.load(std::memory_order_acquire);
+    for (record* r = head; r; r = r->next) {
+      bool expected = false;
+      if (!r->in_use.load(std::memory_order_relaxed) &&
+          r->in_use.compare_exchange_strong(expected, true)) {
+        return r;
+      }
+    }
+    record* r = new record;
+    r->in_use.store(true, std::memory_order_relaxed);
+    r->next = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(
+        r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return r;
+  }
+
+  // Thread local record, released for reuse when the thread exits.
+  record* local_record() {
+    struct holder {
+      record* r = nullptr;
+      ~holder() {
+        if (r) r->in_use.store(false, std::memory_order_release);
+      }
+    };
+    static thread_local holder h;
+    if (!h.r) h.r = acquire_record();
+    return h.r;
+  }
+
+  // Holding mtx_.
+  void try_advance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const epoch_t e = global_epoch_.load(std::memory_order_relaxed);
+    record* head = records_.load(std::memory_order_acquire);
+    for (record* r = head; r; r = r->next) {
+      const epoch_t re = r->epoch.load(std::memory_order_acquire);
+      if (re != 0 && re != e) return;
+    }
+    global_epoch_.store(e + 1, std::memory_order_seq_cst);
+  }
+
+  // Holding mtx_. Readers in a guard have epoch no less than global - 1, so
+  // objects retired before global - 1 are not reachable by any of them.
+  void reclaim() {
+    const epoch_t e = global_epoch_.load(std::memory_order_relaxed);
+    size_t        j = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      if (retired_[i].epoch + 2 <= e) {
+        retired_[i].deleter(retired_[i].ptr);
+      } else {
+        retired_[j++] = retired_[i];
+      }
+    }
+    retired_.resize(j);
+  }
+
+private:
+  std::atomic<epoch_t> global_epoch_{1};
+  std::atomic<record*> records_{nullptr};
+
+  std::mutex             mtx_;  // for writers
+  std::vector<retired_t> retired_;
+};
+
+/// Scoped reader of shared objects in an epoch_domain, which can be nested.
+class epoch_guard {
+public:
+  explicit epoch_guard(epoch_domain& d = epoch_domain::global()) : d_(d) {
+    d_.enter();
+  }
+
+  ~epoch_guard() { d_.leave(); }
+
+  epoch_guard(const epoch_guard&)            = delete;
+  epoch_guard& operator=(const epoch_guard&) = delete;
+
+private:
+  epoch_domain& d_;
+};
+
+}  // namespace maglev
@@ -0,0 +1,84 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <cassert>
+
+namespace maglev {
+
+/// Division free `a % d` for a runtime divisor d, by Lemire's direct
+/// remainder computation with a precomputed 128 bits magic number.
+/// Results are exactly the same as `a % d` for any 64 bits a.
+/// Falls back to hardware division if 128 bits integer is not supported.
+class fast_mod {
+public:
+  using value_t = unsigned long long;
+
+public:
+  fast_mod(value_t d = 1) { set_divisor(d); }
+
+  void set_divisor(value_t d) {
+    assert(d > 0);
+    d_ = d;
+#if defined(__SIZEOF_INT128__)
+    // M = ceil(2^128 / d), it overflows to 0 when d = 1, which also works.
+    m_ = ~uint128_t(0) / d + 1;
+#endif
+  }
+
+  value_t divisor() const { return d_; }
+
+  operator value_t() const { return d_; }
+
+  value_t operator()(value_t a) const {
+#if defined(__SIZEOF_INT128__)
+    uint128_t lowbits = m_ * a;
+    uint128_t bottom  = ((lowbits & ~value_t(0)) * d_) >> 64;
+    uint128_t top     = (lowbits >> 64) * d_;
+    return value_t((bottom + top) >> 64);
+#else
+    return a % d_;
+#endif
+  }
+
+private:
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 uint128_t;
+
+  uint128_t m_ = 0;
+#endif
+  value_t d_ = 1;
+};
+
+/// `a % D` for a compile time divisor D, compilers already turn it into
+/// multiplications and shifts.
+template <unsigned long long D>
+class const_mod {
+  static_assert(D > 0, "divisor must be positive");
+
+public:
+  using value_t = unsigned long long;
+
+public:
+  const_mod(value_t d = D) { assert(d == D); }
+
+  static constexpr value_t divisor() { return D; }
+
+  operator value_t() const { return D; }
+
+  constexpr value_t operator()(value_t a) const { return a % D; }
+};
+
+}  // namespace maglev
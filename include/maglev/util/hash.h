@@ -14,6 +14,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <type_traits>
 
 namespace maglev {
@@ -48,4 +50,18 @@ using def_hash_t = typename std::conditional<
                                               long long>::type>,
     std::hash<T>>::type;
 
+// FNV-1a on 64 bits words instead of bytes, 8 times faster for large data.
+// Size of data must be a multiple of 8 bytes, words are read in host order.
+inline std::uint64_t fnv1a_64_words(const void*   data,
+                                    size_t        n,
+                                    std::uint64_t h = 0xcbf29ce484222325ULL) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i + sizeof(std::uint64_t) <= n; i += sizeof(h)) {
+    std::uint64_t w;
+    std::memcpy(&w, p + i, sizeof(w));
+    h = (h ^ w) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
 }  // namespace maglev
@@ -0,0 +1,289 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace maglev {
+
+/**
+ * Calls heartbeat() of many balancers, or any heartbeat task, periodically on
+ * a few worker threads, so that there is no cron thread per balancer and
+ * heartbeats never run on request threads.
+ *
+ * A timer thread advances a hashed timer wheel of tick length slots, and
+ * hands due tasks to workers. Each task has its own interval and a jitter,
+ * its i-th heartbeat is due at first + i * interval + rand[0, jitter], and the
+ * first is at a random point of the first interval, so that heartbeats of
+ * balancers added together are spread out.
+ *
+ * A heartbeat due while the previous one of the same task is still queued or
+ * running is skipped and counted as an overrun, so a slow task never piles
+ * up. Stats of each task give counts, overruns, durations and start delays.
+ */
+class heartbeat_scheduler {
+public:
+  using clock_t      = std::chrono::steady_clock;
+  using time_point_t = clock_t::time_point;
+  using duration_t   = clock_t::duration;
+  using task_func_t  = std::function<void()>;
+  using task_id_t    = size_t;
+
+  struct task_stats_t {
+    size_t     heartbeat_cnt  = 0;  // heartbeats finished
+    size_t     overrun_cnt    = 0;  // heartbeats skipped as previous not done
+    duration_t last_duration  = duration_t::zero();
+    duration_t max_duration   = duration_t::zero();
+    duration_t total_duration = duration_t::zero();
+    duration_t max_delay      = duration_t::zero();  // from due to start
+  };
+
+public:
+  explicit heartbeat_scheduler(
+      size_t     thread_num = 1,
+      duration_t tick       = std::chrono::milliseconds(10),
+      size_t     wheel_size = 512)
+      : tick_(tick > duration_t::zero() ? tick : duration_t(1)),
+        wheel_(wheel_size > 0 ? wheel_size : 1),
+        start_(clock_t::now()) {
+    thread_num = thread_num > 0 ? thread_num : 1;
+    workers_.reserve(thread_num);
+    for (size_t i = 0; i < thread_num; ++i) {
+      workers_.emplace_back([this]() { work(); });
+    }
+    timer_ = std::thread([this]() { run_timer(); });
+  }
+
+  // Stops at once, heartbeats running are finished, others are dropped.
+  ~heartbeat_scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    timer_cv_.notify_all();
+    ready_cv_.notify_all();
+    timer_.join();
+    for (auto& t : workers_) t.join();
+  }
+
+  heartbeat_scheduler(const heartbeat_scheduler&)            = delete;
+  heartbeat_scheduler& operator=(const heartbeat_scheduler&) = delete;
+
+  size_t     thread_num() const { return workers_.size(); }
+  duration_t tick() const { return tick_; }
+
+  // Heartbeat a balancer, or any object with a heartbeat() method, which must
+  // outlive the task, i.e. be removed before destroyed.
+  template <typename HeartbeatType>
+  task_id_t add(HeartbeatType& b,
+                duration_t     interval,
+                duration_t     jitter = duration_t::zero()) {
+    return add_task([&b]() { b.heartbeat(); }, interval, jitter);
+  }
+
+  task_id_t add_task(task_func_t f,
+                     duration_t  interval,
+                     duration_t  jitter = duration_t::zero()) {
+    assert(f);
+    auto t      = std::make_shared<task_t>();
+    t->func     = std::move(f);
+    t->interval = std::max(interval, tick_);
+    t->jitter   = std::max(jitter, duration_t::zero());
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    t->id    = ++last_id_;
+    t->first = clock_t::now() + random_in(t->interval);
+    schedule(t, t->first);
+    tasks_.emplace(t->id, t);
+    return t->id;
+  }
+
+  // Remove a task, and wait for its running heartbeat if any, unless called
+  // by the heartbeat itself. Return false if not found.
+  bool remove(task_id_t id) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    auto                         it = tasks_.find(id);
+    if (it == tasks_.end()) return false;
+    task_ptr_t t = it->second;
+    tasks_.erase(it);
+    t->removed = true;
+    if (t->runner != std::this_thread::get_id()) {
+      done_cv_.wait(lock, [&]() { return t->state != state_running; });
+    }
+    return true;
+  }
+
+  // Copy stats of a task, return false if not found.
+  bool stats(task_id_t id, task_stats_t& s) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto                        it = tasks_.find(id);
+    if (it == tasks_.end()) return false;
+    s = it->second->stats;
+    return true;
+  }
+
+  size_t task_size() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return tasks_.size();
+  }
+
+private:
+  enum state_t { state_idle, state_queued, state_running };
+
+  struct task_t {
+    task_id_t       id = 0;
+    task_func_t     func;
+    duration_t      interval;
+    duration_t      jitter;
+    time_point_t    first;
+    size_t          period  = 0;  // index of the heartbeat scheduled
+    time_point_t    due;          // due time of the heartbeat scheduled
+    time_point_t    queued_due;   // due time of the heartbeat queued
+    state_t         state   = state_idle;
+    bool            removed = false;
+    std::thread::id runner;
+    task_stats_t    stats;
+  };
+
+  using task_ptr_t = std::shared_ptr<task_t>;
+
+  struct entry_t {
+    size_t     tick_idx;
+    task_ptr_t task;
+  };
+
+  duration_t random_in(duration_t d) {
+    if (d <= duration_t::zero()) return duration_t::zero();
+    return duration_t(std::uniform_int_distribution<duration_t::rep>(
+        0, d.count() - 1)(rng_));
+  }
+
+  // Put a task in the wheel slot of the first tick not before due.
+  void schedule(const task_ptr_t& t, time_point_t due) {
+    t->due     = due;
+    auto   off = std::max(due - start_, duration_t::zero());
+    size_t idx = size_t((off + tick_ - duration_t(1)) / tick_);
+    idx        = std::max(idx, curr_tick_ + 1);
+    wheel_[idx % wheel_.size()].push_back({idx, t});
+  }
+
+  // Schedule the heartbeat after the one due now.
+  void schedule_next(const task_ptr_t& t) {
+    ++t->period;
+    schedule(t, t->first + t->interval * t->period + random_in(t->jitter));
+  }
+
+  // Fire tasks due at a tick, must hold the lock.
+  void fire(size_t tick_idx) {
+    auto& slot = wheel_[tick_idx % wheel_.size()];
+    for (size_t i = 0; i < slot.size();) {
+      if (slot[i].tick_idx != tick_idx && !slot[i].task->removed) {
+        ++i;
+        continue;
+      }
+      entry_t e = std::move(slot[i]);
+      slot[i]   = std::move(slot.back());
+      slot.pop_back();
+      auto& t = e.task;
+      if (t->removed) continue;
+      if (t->state != state_idle) {
+        ++t->stats.overrun_cnt;
+      } else {
+        t->state      = state_queued;
+        t->queued_due = t->due;
+        ready_.push_back(t);
+        ready_cv_.notify_one();
+      }
+      schedule_next(t);
+    }
+  }
+
+  void run_timer() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!stop_) {
+      time_point_t next = start_ + tick_ * (curr_tick_ + 1);
+      timer_cv_.wait_until(lock, next, [&]() { return stop_; });
+      if (stop_) return;
+      // catch up ticks missed by a late wake up
+      size_t now_tick = size_t((clock_t::now() - start_) / tick_);
+      while (curr_tick_ < now_tick) fire(++curr_tick_);
+    }
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (true) {
+      ready_cv_.wait(lock, [&]() { return stop_ || !ready_.empty(); });
+      if (stop_) return;
+      task_ptr_t t = std::move(ready_.front());
+      ready_.pop_front();
+      if (t->removed) {
+        t->state = state_idle;
+        continue;
+      }
+      t->state             = state_running;
+      t->runner            = std::this_thread::get_id();
+      time_point_t started = clock_t::now();
+      lock.unlock();
+
+      t->func();
+
+      time_point_t finished = clock_t::now();
+      lock.lock();
+      auto&      s = t->stats;
+      duration_t d = finished - started;
+      ++s.heartbeat_cnt;
+      s.last_duration = d;
+      s.max_duration  = std::max(s.max_duration, d);
+      s.total_duration += d;
+      s.max_delay = std::max(s.max_delay, started - t->queued_due);
+      t->state    = state_idle;
+      t->runner   = std::thread::id();
+      done_cv_.notify_all();
+    }
+  }
+
+private:
+  const duration_t                  tick_;
+  std::vector<std::vector<entry_t>> wheel_;
+  const time_point_t                start_;
+  size_t                            curr_tick_ = 0;
+
+  std::unordered_map<task_id_t, task_ptr_t> tasks_;
+  std::deque<task_ptr_t>                    ready_;
+  task_id_t                                 last_id_ = 0;
+  std::mt19937_64                           rng_{std::random_device{}()};
+
+  mutable std::mutex       mtx_;
+  std::condition_variable  timer_cv_;
+  std::condition_variable  ready_cv_;
+  std::condition_variable  done_cv_;
+  bool                     stop_ = false;
+  std::thread              timer_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace maglev
@@ -16,39 +16,67 @@
 
 namespace maglev {
 
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 uint128_t;
+#endif
+
+// a * b % m without overflow for any 64 bits integers.
+inline constexpr unsigned long long mul_mod(unsigned long long a,
+                                            unsigned long long b,
+                                            unsigned long long m) {
+#if defined(__SIZEOF_INT128__)
+  return (unsigned long long)(uint128_t(a) * b % m);
+#else
+  a %= m;
+  unsigned long long ret = 0;
+  while (b > 0) {
+    if (b & 1) ret = ret >= m - a ? ret - (m - a) : ret + a;
+    a = a >= m - a ? a - (m - a) : a + a;
+    b >>= 1;
+  }
+  return ret;
+#endif
+}
+
 template <typename T, typename V>
 inline constexpr T power(T x, unsigned long long n, V mod) {
   x %= mod;
   T ret = 1;
   while (n > 0) {
-    if (n & 1) ret = ret * x % mod;
-    x = x * x % mod;
+    if (n & 1) ret = mul_mod(ret, x, mod);
+    x = mul_mod(x, x, mod);
     n >>= 1;
   }
   return ret;
 }
 
-// MillerRabin prime test for n < 4,759,123,141 (4,759,123,141 > 4,294,967,295)
-inline constexpr bool is_prime(unsigned int n) {
+// MillerRabin prime test for any 64 bits n. Bases {2, 7, 61} are enough for
+// n < 4,759,123,141, and the first 12 primes for n < 2^64.
+inline constexpr bool is_prime(unsigned long long n) {
   if (n == 2) return true;
   if ((~n & 1) || n == 1) return false;
 
-  // form n - 1 = d * 2 ^ r//
-  unsigned int d = (n - 1) >> 1;
-  unsigned int r = 1;
+  // form n - 1 = d * 2 ^ r
+  unsigned long long d = (n - 1) >> 1;
+  unsigned int       r = 1;
   while (~d & 1) {
     d >>= 1;
     ++r;
   }
 
-  constexpr unsigned int a[3] = {2, 7, 61};
-  for (int i = 0; i < 3; ++i) {
+  constexpr unsigned long long a32[3] = {2, 7, 61};
+  constexpr unsigned long long a64[12] =
+      {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+  const bool                small = n < 4759123141ULL;
+  const unsigned long long* a     = small ? a32 : a64;
+  const int                 a_num = small ? 3 : 12;
+  for (int i = 0; i < a_num; ++i) {
     if (a[i] == n) return true;
-    auto x = power((unsigned long long)(a[i]), d, n);
+    auto x = power(a[i], d, n);
     if (x == 1 || x == n - 1) continue;
     // repeat r-1 times
-    for (int k = 1; k < r; ++k) {
-      x = 1ULL * x * x % n;
+    for (unsigned int k = 1; k < r; ++k) {
+      x = mul_mod(x, x, n);
       if (x == 1) return false;
       if (x == n - 1) break;
     }
@@ -57,4 +85,13 @@ inline constexpr bool is_prime(unsigned int n) {
   return true;
 }
 
+// The smallest prime not less than n, usable at compile time, e.g.
+// slot_array<int, next_prime(100000)>.
+inline constexpr unsigned long long next_prime(unsigned long long n) {
+  if (n <= 2) return 2;
+  if (~n & 1) ++n;
+  while (!is_prime(n)) n += 2;
+  return n;
+}
+
 }  // namespace maglev
@@ -0,0 +1,222 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace maglev {
+
+/**
+ * A named POSIX shared memory region of fixed size blocks, found by 64 bit
+ * keys, for stats shared by processes on a host, e.g. pre-forked workers.
+ *
+ * Blocks are zero filled when the region is created and never freed, so a
+ * block type must be valid when all zero, such as lock-free atomics of
+ * integers. A key is claimed by a CAS in an open addressing table, so any
+ * process finds or creates a block without locks.
+ *
+ * The region also holds a lease, owned by one process at a time until it
+ * expires, e.g. to let only one process advance shared sliding windows at
+ * heartbeat. Owner and expiration are in one word, so that two processes
+ * never both take an expired lease.
+ */
+class shm_region {
+public:
+  using key_t = std::uint64_t;
+
+  static constexpr size_t        cacheline_size = 64;
+  static constexpr std::uint64_t magic          = 0x6d61676c65767368ULL;
+
+  struct alignas(cacheline_size) header_t {
+    std::atomic<std::uint64_t> magic;
+    std::atomic<std::uint64_t> lease;  // expire ms << 24 | owner token
+    std::uint64_t              block_size;
+    std::uint64_t              block_cnt;
+  };
+
+  struct alignas(cacheline_size) entry_t {
+    std::atomic<key_t> key;  // 0 if free
+  };
+
+public:
+  shm_region() = default;
+  ~shm_region() { close(); }
+
+  shm_region(const shm_region&)            = delete;
+  shm_region& operator=(const shm_region&) = delete;
+
+  // Create the region, or open it if it exists with the same geometry. Name
+  // is as of shm_open(), e.g. "/maglev_stats". Return false on failure.
+  bool open(const std::string& name, size_t block_size, size_t block_cnt) {
+    close();
+    if (block_size == 0 || block_cnt == 0) return false;
+    block_size = (block_size + cacheline_size - 1) / cacheline_size *
+                 cacheline_size;
+    size_t size = sizeof(header_t) + block_cnt * sizeof(entry_t) +
+                  block_cnt * block_size;
+
+    bool created = true;
+    int  fd      = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      created = false;
+      fd      = ::shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0) return false;
+    if (created && ::ftruncate(fd, off_t(size)) != 0) {
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      return false;
+    }
+    // the creator may not have sized it yet
+    struct stat st;
+    for (int i = 0; !created; ++i) {
+      if (::fstat(fd, &st) != 0 || i > 1000) {
+        ::close(fd);
+        return false;
+      }
+      if (size_t(st.st_size) >= size) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+
+    addr_ = p;
+    size_ = size;
+    header_t* h = header();
+    if (created) {
+      h->block_size = block_size;
+      h->block_cnt  = block_cnt;
+      h->magic.store(magic, std::memory_order_release);
+    } else {
+      for (int i = 0; h->magic.load(std::memory_order_acquire) != magic; ++i) {
+        if (i > 1000) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      if (h->magic.load(std::memory_order_acquire) != magic ||
+          h->block_size != block_size || h->block_cnt != block_cnt) {
+        close();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void close() {
+    if (addr_) ::munmap(addr_, size_);
+    addr_ = nullptr;
+    size_ = 0;
+  }
+
+  // Remove the name, mappings of processes are kept until closed.
+  static bool unlink(const std::string& name) {
+    return ::shm_unlink(name.c_str()) == 0;
+  }
+
+  bool   is_open() const { return addr_ != nullptr; }
+  size_t block_size() const { return is_open() ? header()->block_size : 0; }
+  size_t block_cnt() const { return is_open() ? header()->block_cnt : 0; }
+
+  // Find the block of a key, or claim a free one. Return nullptr if full.
+  void* block(key_t key) {
+    assert(is_open());
+    key_t  k = key != 0 ? key : ~key_t{0};
+    size_t n = block_cnt();
+    for (size_t i = 0; i < n; ++i) {
+      size_t              idx = (k + i) % n;
+      std::atomic<key_t>& e   = entries()[idx].key;
+      key_t               cur = e.load(std::memory_order_acquire);
+      if (cur == 0 && e.compare_exchange_strong(cur, k)) return block_at(idx);
+      if (cur == k) return block_at(idx);
+    }
+    return nullptr;
+  }
+
+  // As block(), but also return nullptr if a block is smaller than T.
+  template <typename T>
+  T* block_as(key_t key) {
+    if (sizeof(T) > block_size()) return nullptr;
+    return static_cast<T*>(block(key));
+  }
+
+  // Token of this process for the lease, pid by default.
+  std::uint64_t lease_token() const { return token_; }
+  void set_lease_token(std::uint64_t t) { token_ = t & token_mask; }
+
+  // Take or renew the lease for ttl, return whether this process holds it.
+  bool try_lease(std::chrono::milliseconds ttl) {
+    assert(is_open());
+    std::atomic<std::uint64_t>& l   = header()->lease;
+    std::uint64_t               now = now_ms();
+    std::uint64_t               cur = l.load(std::memory_order_acquire);
+    if ((cur & token_mask) != token_ && (cur >> token_bits) > now) {
+      return false;
+    }
+    std::uint64_t next = (now + std::uint64_t(ttl.count())) << token_bits;
+    return l.compare_exchange_strong(cur, next | token_);
+  }
+
+  // Whether this process holds an unexpired lease.
+  bool lease_held() const {
+    if (!is_open()) return false;
+    std::uint64_t cur = header()->lease.load(std::memory_order_acquire);
+    return (cur & token_mask) == token_ && (cur >> token_bits) > now_ms();
+  }
+
+  void release_lease() {
+    if (!is_open()) return;
+    std::uint64_t cur = header()->lease.load(std::memory_order_acquire);
+    if ((cur & token_mask) == token_) {
+      header()->lease.compare_exchange_strong(cur, 0);
+    }
+  }
+
+private:
+  static constexpr int           token_bits = 24;
+  static constexpr std::uint64_t token_mask = (1ULL << token_bits) - 1;
+
+  // Monotonic clock of the host, the same in all processes.
+  static std::uint64_t now_ms() {
+    auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return std::uint64_t(
+        std::chrono::duration_cast<std::chrono::milliseconds>(t).count());
+  }
+
+  header_t*       header() { return static_cast<header_t*>(addr_); }
+  const header_t* header() const { return static_cast<header_t*>(addr_); }
+  entry_t*        entries() { return reinterpret_cast<entry_t*>(header() + 1); }
+  void*           block_at(size_t idx) {
+    char* b = reinterpret_cast<char*>(entries() + block_cnt());
+    return b + idx * block_size();
+  }
+
+private:
+  void*         addr_  = nullptr;
+  size_t        size_  = 0;
+  std::uint64_t token_ = std::uint64_t(::getpid()) & token_mask;
+};
+
+}  // namespace maglev
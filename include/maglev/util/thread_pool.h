@@ -0,0 +1,136 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace maglev {
+
+/// A fixed size thread pool to run a parallel for loop, blocking until the
+/// whole loop is done. It is an executor for maglev_hasher::build(executor).
+///
+/// An executor is any type with method `parallel_for(n, f)`, which calls
+/// `f(begin, end)` on disjoint sub ranges covering [0, n) and returns after
+/// all calls finished.
+class thread_pool {
+public:
+  using range_func_t = std::function<void(size_t, size_t)>;
+
+public:
+  // Total thread number including the calling thread of parallel_for.
+  explicit thread_pool(size_t thread_num = std::thread::hardware_concurrency())
+      : thread_num_(thread_num > 0 ? thread_num : 1) {
+    workers_.reserve(thread_num_ - 1);
+    for (size_t i = 1; i < thread_num_; ++i) {
+      workers_.emplace_back([this, i]() { work(i); });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+      ++generation_;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) t.join();
+  }
+
+  thread_pool(const thread_pool&)            = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  size_t thread_num() const { return thread_num_; }
+
+  template <typename Function>
+  void parallel_for(size_t n, Function&& f) {
+    if (thread_num_ == 1 || n <= 1) {
+      if (n > 0) f(size_t(0), n);
+      return;
+    }
+    range_func_t func = std::forward<Function>(f);
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      func_ = &func;
+      n_    = n;
+      running_.store(thread_num_ - 1, std::memory_order_relaxed);
+      ++generation_;
+    }
+    cv_.notify_all();
+
+    run_chunk(0, func, n);
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_cv_.wait(lock, [this]() {
+      return running_.load(std::memory_order_acquire) == 0;
+    });
+    func_ = nullptr;
+  }
+
+private:
+  void run_chunk(size_t i, const range_func_t& func, size_t n) const {
+    size_t b = n * i / thread_num_, e = n * (i + 1) / thread_num_;
+    if (b < e) func(b, e);
+  }
+
+  void work(size_t i) {
+    size_t seen_generation = 0;
+    while (true) {
+      const range_func_t* func = nullptr;
+      size_t              n    = 0;
+      {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [&]() { return generation_ != seen_generation; });
+        seen_generation = generation_;
+        if (stop_) return;
+        func = func_;
+        n    = n_;
+      }
+      run_chunk(i, *func, n);
+      if (running_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        done_cv_.notify_one();
+      }
+    }
+  }
+
+private:
+  const size_t             thread_num_;
+  std::vector<std::thread> workers_;
+
+  std::mutex              mtx_;
+  std::condition_variable cv_;
+  std::condition_variable done_cv_;
+  size_t                  generation_ = 0;
+  bool                    stop_       = false;
+  const range_func_t*     func_       = nullptr;
+  size_t                  n_          = 0;
+  std::atomic<size_t>     running_{0};
+};
+
+/// An executor running the whole loop on the calling thread.
+struct inline_executor {
+  template <typename Function>
+  void parallel_for(size_t n, Function&& f) {
+    if (n > 0) f(size_t(0), n);
+  }
+};
+
+}  // namespace maglev
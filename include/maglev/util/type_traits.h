@@ -64,4 +64,20 @@ using has_stats_t = typename has_stats<NodeT>::type;
 template <typename NodeT>
 constexpr bool has_stats_v = has_stats_t<NodeT>::value;
 
+/* ***** is bit packed ***** */
+
+template <typename SlotArrayT, typename = void>
+struct is_bit_packed : std::false_type {};
+
+template <class SlotArrayT>
+struct is_bit_packed<SlotArrayT, typename SlotArrayT::bit_packed_t>
+    : std::true_type {};
+
+template <typename SlotArrayT>
+using is_bit_packed_t = typename is_bit_packed<SlotArrayT>::type;
+
+// variable template, since C++14
+template <typename SlotArrayT>
+constexpr bool is_bit_packed_v = is_bit_packed_t<SlotArrayT>::value;
+
 }  // namespace maglev
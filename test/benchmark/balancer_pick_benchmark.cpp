@@ -0,0 +1,110 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <algorithm>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+using server_balancer_t = maglev::maglev_balancer<maglev::maglev_hasher<
+    maglev::load_stats_wrapper<maglev::node_base<int>,
+                               maglev::server_load_stats_wrapper<>>,
+    maglev::slot_vector<>>>;
+
+// Record a query to the picked node, with errors and latencies by node.
+void feed(server_balancer_t& b, const server_balancer_t::pick_ret_t& ret) {
+  int  id    = ret.node->id();
+  bool fatal = id == 3;
+  bool error = fatal || id % 7 == 0;
+  int  lat   = 100 + id % 13 * 10;
+  ret.node->incr_load();
+  b.global_load().incr_load();
+  ret.node->incr_server_load(1, error, fatal, lat);
+  b.global_load().incr_server_load(1, error, fatal, lat);
+}
+
+// Some heartbeats of queries, so that stats, ranks and bans are warmed up.
+void warm_up(server_balancer_t& b, size_t key_size, int heartbeat_size) {
+  for (int t = 0; t < heartbeat_size; ++t) {
+    for (size_t k = 0; k < key_size; ++k) {
+      feed(b, b.pick(maglev::def_hash_t<size_t>{}(k * 31 + t)));
+    }
+    b.heartbeat();
+  }
+}
+
+void pick_case(const options& opt,
+               int            node_size,
+               size_t         slot_size,
+               bool           precomputed_verdict) {
+  run_case(opt, [&]() {
+    server_balancer_t b;
+    b.balance_strategy().precomputed_verdict = precomputed_verdict;
+    b.slot_array().resize(slot_size);
+    for (int i = 0; i < node_size; ++i) b.node_manager().new_back(i);
+    b.build();
+    warm_up(b, size_t(node_size) * 100, 10);
+
+    // Time picks only, queries are fed to keep stats of now growing as in
+    // real traffic.
+    constexpr size_t batch     = 1024;
+    const size_t     pick_size = opt.quick ? 1000000 : 10000000;
+    size_t           check     = 0;
+    double           ns        = 0;
+    for (size_t i = 0; i < pick_size; i += batch) {
+      server_balancer_t::pick_ret_t ret[batch];
+      const size_t                  m     = std::min(batch, pick_size - i);
+      auto                          start = steady_clock_t::now();
+      for (size_t j = 0; j < m; ++j) {
+        ret[j] = b.pick(maglev::def_hash_t<size_t>{}(i + j));
+      }
+      ns += elapsed_ns(start);
+      for (size_t j = 0; j < m; ++j) {
+        check += ret[j].node_idx + ret[j].retry_cnt;
+        feed(b, ret[j]);
+      }
+    }
+    std::printf("%-10s %8d %10zu %14.0f %10.2f %12zu\n",
+                precomputed_verdict ? "verdict" : "live",
+                node_size,
+                slot_size,
+                pick_size / ns * 1e9,
+                ns / pick_size,
+                check);
+  });
+}
+
+}  // namespace
+
+// Picks per second of a balancer on server_load_stats, with stats checked
+// live in pick or by verdicts precomputed at heartbeat.
+MAGLEV_BENCHMARK(balancer_pick) {
+  std::vector<int> node_sizes = {10, 100, 1000};
+  if (opt.quick) node_sizes = {100};
+  std::printf("%-10s %8s %10s %14s %10s %12s\n",
+              "mode",
+              "nodes",
+              "slots",
+              "picks/s",
+              "ns/pick",
+              "check");
+  for (int node_size : node_sizes) {
+    for (bool v : {false, true}) { pick_case(opt, node_size, 65537, v); }
+  }
+}
+
+}  // namespace maglev_benchmark
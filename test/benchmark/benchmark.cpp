@@ -0,0 +1,48 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "benchmark.h"
+
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char** argv) {
+  maglev_benchmark::options opt;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--quick") == 0) {
+      opt.quick = true;
+    } else if (std::strcmp(argv[i], "--exact_quota") == 0) {
+      opt.exact_quota = true;
+    } else if (std::strcmp(argv[i], "--no_fork") == 0) {
+      opt.fork = false;
+    } else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+      opt.filter = argv[i] + 9;
+    } else {
+      std::cout << "Usage: " << argv[0]
+                << " [--quick] [--exact_quota] [--no_fork] [--filter=NAME]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  std::cout << ">>> Running maglev benchmark." << std::endl;
+
+  for (const auto& b : maglev_benchmark::registry()) {
+    if (b.first.find(opt.filter) == std::string::npos) continue;
+    std::cout << ">>> " << b.first << std::endl;
+    b.second(opt);
+  }
+
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#pragma once
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "maglev/maglev.h"
+
+namespace maglev_benchmark {
+
+struct options {
+  bool        quick       = false;  // small sizes only
+  bool        exact_quota = false;  // build hashers in exact quota mode
+  bool        fork        = true;   // run each case in a child process
+  std::string filter;               // run benchmarks whose name contains it
+};
+
+using benchmark_func_t = void (*)(const options&);
+
+inline std::vector<std::pair<std::string, benchmark_func_t>>& registry() {
+  static std::vector<std::pair<std::string, benchmark_func_t>> r;
+  return r;
+}
+
+struct registrar {
+  registrar(const char* name, benchmark_func_t f) {
+    registry().emplace_back(name, f);
+  }
+};
+
+#define MAGLEV_BENCHMARK(name)                                        \
+  static void                          name(const options&);          \
+  static ::maglev_benchmark::registrar name##_registrar(#name, name); \
+  static void                          name(const options& opt)
+
+using steady_clock_t = std::chrono::steady_clock;
+
+inline double elapsed_ns(steady_clock_t::time_point start) {
+  using ns_t = std::chrono::duration<double, std::nano>;
+  return ns_t(steady_clock_t::now() - start).count();
+}
+
+// Peak resident set size of this process in KB.
+inline long peak_rss_kb() {
+  struct rusage u;
+  getrusage(RUSAGE_SELF, &u);
+  return u.ru_maxrss;
+}
+
+// Run a case in a child process if opt.fork, so that peak memory reported by
+// the case is its own rather than the maximum of all cases so far.
+template <typename Function>
+void run_case(const options& opt, Function&& f) {
+  if (!opt.fork) {
+    f();
+    return;
+  }
+  std::fflush(stdout);
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    f();
+    std::fflush(stdout);
+    _exit(0);
+  }
+  if (pid < 0) {
+    f();
+    return;
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+}
+
+}  // namespace maglev_benchmark
@@ -0,0 +1,170 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+using default_balancer_t = maglev::maglev_balancer<maglev::maglev_hasher<
+    maglev::load_stats_wrapper<maglev::node_base<int>, maglev::load_stats<>>,
+    maglev::slot_vector<>>>;
+
+using bounded_balancer_t = maglev::maglev_balancer<
+    maglev::maglev_hasher<
+        maglev::load_stats_wrapper<maglev::node_base<int>,
+                                   maglev::inflight_wrapper<>>,
+        maglev::slot_vector<>>,
+    maglev::bounded_load_balance_strategy>;
+
+// Zipf distribution of keys in [0, key_size), with exponent s.
+class zipf_keys {
+public:
+  zipf_keys(size_t key_size, double s) : cdf_(key_size) {
+    double sum = 0;
+    for (size_t i = 0; i < key_size; ++i) {
+      sum += 1 / std::pow(double(i + 1), s);
+      cdf_[i] = sum;
+    }
+    for (auto& c : cdf_) c /= sum;
+  }
+
+  template <typename Rng>
+  size_t operator()(Rng& rng) {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+  }
+
+private:
+  std::vector<double> cdf_;
+};
+
+template <typename NodePtrType>
+void start_query(default_balancer_t& b, const NodePtrType& n) {
+  n->incr_load();
+  b.global_load().incr_load();
+}
+
+template <typename NodePtrType>
+void start_query(bounded_balancer_t& b, const NodePtrType& n) {
+  n->incr_load();
+  b.global_load().incr_load();
+  n->incr_inflight();
+  b.global_load().incr_inflight();
+}
+
+template <typename NodePtrType>
+void finish_query(default_balancer_t& b, const NodePtrType& n) {}
+
+template <typename NodePtrType>
+void finish_query(bounded_balancer_t& b, const NodePtrType& n) {
+  n->decr_inflight();
+  b.global_load().decr_inflight();
+}
+
+// Keep inflight_size queries in flight, each finishes after inflight_size
+// more picks, and heartbeat every 1000 picks. In-flight counts of nodes are
+// tracked here for all balancers.
+template <typename BalancerType>
+void simulate(const options& opt,
+              const char*    mode,
+              BalancerType&  b,
+              double         skew) {
+  const int    node_size     = 100;
+  const size_t inflight_size = node_size * 20;
+  const size_t pick_size     = opt.quick ? 200000 : 2000000;
+  b.slot_array().resize(65537);
+  for (int i = 0; i < node_size; ++i) b.node_manager().new_back(i);
+  b.build();
+
+  std::mt19937_64     rng(12345);
+  zipf_keys           keys(100000, skew);
+  std::vector<size_t> ring(inflight_size, node_size);  // node idx of queries
+  std::vector<size_t> cnt(node_size + 1, 0);
+  double              ratio_sum = 0, ratio_max = 0;
+  size_t              inconsistent_cnt = 0, retry_sum = 0;
+  for (size_t i = 0; i < pick_size; ++i) {
+    size_t& q = ring[i % inflight_size];
+    if (q < size_t(node_size)) {
+      finish_query(b, b.node_manager()[q]);
+      --cnt[q];
+    }
+    auto ret = b.pick(maglev::def_hash_t<size_t>{}(keys(rng)));
+    start_query(b, ret.node);
+    q = ret.node_idx;
+    ++cnt[q];
+    inconsistent_cnt += !ret.is_consistent;
+    retry_sum += ret.retry_cnt;
+    if (i % 1000 == 999) b.heartbeat();
+    // measure once all queries are in flight
+    if (i >= inflight_size && i % 100 == 0) {
+      double r = *std::max_element(cnt.begin(), cnt.end() - 1) * node_size /
+                 double(inflight_size);
+      ratio_sum += r;
+      ratio_max = std::max(ratio_max, r);
+    }
+  }
+  size_t samples = (pick_size - inflight_size) / 100;
+  std::printf("%-14s %6.2f %12.3f %12.3f %14.4f %10.3f\n",
+              mode,
+              skew,
+              ratio_sum / samples,
+              ratio_max,
+              double(inconsistent_cnt) / pick_size,
+              double(retry_sum) / pick_size);
+}
+
+}  // namespace
+
+// Max over avg of in-flight queries of nodes, with zipf distributed keys, for
+// balancing without load rule, by the default load rule, and by bounded
+// loads.
+MAGLEV_BENCHMARK(bounded_load) {
+  std::vector<double> skews = {0, 0.8, 1.0, 1.2};
+  if (opt.quick) skews = {0, 1.0};
+  std::printf("%-14s %6s %12s %12s %14s %10s\n",
+              "mode",
+              "skew",
+              "avg_max/avg",
+              "max_max/avg",
+              "inconsistent",
+              "avg_retry");
+  for (double skew : skews) {
+    run_case(opt, [&]() {
+      default_balancer_t b;
+      b.balance_strategy().eps_of_load_to_balance =
+          std::numeric_limits<double>::max();
+      simulate(opt, "consistent", b, skew);
+    });
+    run_case(opt, [&]() {
+      default_balancer_t b;
+      simulate(opt, "default", b, skew);
+    });
+    for (double eps : {0.25, 0.1}) {
+      run_case(opt, [&]() {
+        bounded_balancer_t b;
+        b.balance_strategy().eps_of_bounded_load = eps;
+        simulate(opt, eps == 0.25 ? "bounded_0.25" : "bounded_0.10", b, skew);
+      });
+    }
+  }
+}
+
+}  // namespace maglev_benchmark
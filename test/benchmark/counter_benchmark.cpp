@@ -0,0 +1,92 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <atomic>
+#include <thread>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+// Threads increment load of one node and of global load, as picks of a hot
+// key, while a heartbeat thread folds now into the windows.
+template <typename LoadStatsType>
+void counter_case(const options& opt, const char* mode, int thread_size) {
+  run_case(opt, [&]() {
+    LoadStatsType     node, global;
+    const size_t      incr_size = opt.quick ? 200000 : 2000000;
+    std::atomic<int>  ready{0};
+    std::atomic<bool> start{false}, stop{false};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_size; ++t) {
+      threads.emplace_back([&]() {
+        ++ready;
+        while (!start) std::this_thread::yield();
+        for (size_t i = 0; i < incr_size; ++i) {
+          node.incr_load();
+          global.incr_load();
+        }
+      });
+    }
+    unsigned long long taken = 0;
+    std::thread        heartbeat([&]() {
+      while (!stop) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        node.heartbeat();
+        taken += node.load().last();
+      }
+    });
+
+    while (ready != thread_size) std::this_thread::yield();
+    auto begin = steady_clock_t::now();
+    start      = true;
+    for (auto& t : threads) t.join();
+    double ns = elapsed_ns(begin);
+    stop      = true;
+    heartbeat.join();
+    taken += node.load().now();
+
+    double incr_cnt = double(incr_size) * thread_size;
+    std::printf("%-10s %8d %14.1f %10.2f %8s\n",
+                mode,
+                thread_size,
+                incr_cnt / ns * 1e3,
+                ns / incr_size,
+                taken == incr_cnt ? "ok" : "lost");
+  });
+}
+
+}  // namespace
+
+// Increments per second of load_stats with now in an atomic counter or in per
+// thread shards, by 1 to 64 threads.
+MAGLEV_BENCHMARK(counter) {
+  std::vector<int> thread_sizes = {1, 2, 4, 8, 16, 32, 64};
+  if (opt.quick) thread_sizes = {1, 4, 16};
+  std::printf("%-10s %8s %14s %10s %8s\n",
+              "mode",
+              "threads",
+              "Mincr/s",
+              "ns/round",
+              "check");
+  for (int thread_size : thread_sizes) {
+    counter_case<maglev::load_stats<>>(opt, "atomic", thread_size);
+    counter_case<maglev::sharded_load_stats<>>(opt, "sharded", thread_size);
+  }
+}
+
+}  // namespace maglev_benchmark
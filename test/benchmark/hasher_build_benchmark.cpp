@@ -0,0 +1,218 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <algorithm>
+#include <thread>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+using unweighted_hasher_t =
+    maglev::maglev_hasher<maglev::node_base<int>, maglev::slot_vector<>>;
+
+using slot_counted_hasher_t = maglev::maglev_hasher<
+    maglev::slot_counted_node_wrapper<maglev::node_base<int>>,
+    maglev::slot_vector<>>;
+
+using weighted_hasher_t = maglev::maglev_hasher<
+    maglev::weighted_node_wrapper<maglev::node_base<int>>,
+    maglev::slot_vector<>>;
+
+// Weights in [1, skew], spread over nodes by a multiplicative hash.
+unsigned int weight_of(int node_id, unsigned int skew) {
+  return 1 + unsigned(node_id) * 2654435761U % skew;
+}
+
+void add_nodes(unweighted_hasher_t& h, int node_size, unsigned int) {
+  for (int i = 0; i < node_size; ++i) h.node_manager().new_back(i);
+}
+
+void add_nodes(slot_counted_hasher_t& h, int node_size, unsigned int) {
+  for (int i = 0; i < node_size; ++i) h.node_manager().new_back(i);
+}
+
+void add_nodes(weighted_hasher_t& h, int node_size, unsigned int skew) {
+  for (int i = 0; i < node_size; ++i) {
+    h.node_manager().new_back(i)->set_weight(weight_of(i, skew));
+  }
+}
+
+// Slot count of each node, indexed as in node manager.
+template <typename HasherType>
+std::vector<double> slot_counts(const HasherType& h) {
+  std::vector<double> cnt(h.node_size(), 0);
+  for (size_t i = 0; i < h.slot_size(); ++i) ++cnt[h.slot_array()[i]];
+  return cnt;
+}
+
+// Max of slot count over expected slot count of all nodes.
+double imbalance(const unweighted_hasher_t& h) {
+  auto cnt = slot_counts(h);
+  return *std::max_element(cnt.begin(), cnt.end()) * h.node_size() /
+         h.slot_size();
+}
+
+// By slot_cnt of nodes, as the node type records it.
+double imbalance(const slot_counted_hasher_t& h) {
+  int max_cnt = 0;
+  for (const auto& n : h.node_manager()) {
+    max_cnt = std::max(max_cnt, n->slot_cnt());
+  }
+  return double(max_cnt) * h.node_size() / h.slot_size();
+}
+
+// Slot count is normalized by weight.
+double imbalance(const weighted_hasher_t& h) {
+  auto   cnt   = slot_counts(h);
+  auto&  nm    = h.node_manager();
+  double w_sum = 0, ret = 0;
+  for (const auto& n : nm) w_sum += n->weight();
+  for (size_t i = 0; i < cnt.size(); ++i) {
+    double expected = double(h.slot_size()) * nm[i]->weight() / w_sum;
+    ret             = std::max(ret, cnt[i] / expected);
+  }
+  return ret;
+}
+
+template <typename HasherType>
+void build_case(const options& opt,
+                const char*    config,
+                int            node_size,
+                size_t         slot_size,
+                unsigned int   skew) {
+  run_case(opt, [&]() {
+    HasherType h;
+    h.set_exact_quota(opt.exact_quota);
+    h.slot_array().resize(slot_size);
+    add_nodes(h, node_size, skew);
+    auto   start = steady_clock_t::now();
+    h.build();
+    double ns = elapsed_ns(start);
+    std::printf("%-14s %8d %10zu %6u %12.3f %10.2f %12.1f %10.4f\n",
+                config,
+                node_size,
+                slot_size,
+                skew,
+                ns / 1e6,
+                ns / slot_size,
+                peak_rss_kb() / 1024.0,
+                imbalance(h));
+  });
+}
+
+template <typename HasherType>
+void build_parallel_case(const options& opt,
+                         const char*    config,
+                         int            node_size,
+                         size_t         slot_size,
+                         unsigned int   skew) {
+  run_case(opt, [&]() {
+    HasherType h;
+    h.set_exact_quota(opt.exact_quota);
+    h.slot_array().resize(slot_size);
+    add_nodes(h, node_size, skew);
+    auto start = steady_clock_t::now();
+    h.build();
+    double base_ns = elapsed_ns(start);
+    auto   slots   = h.slot_array();
+    for (size_t thread_num : {1, 2, 4, 8, 16}) {
+      maglev::thread_pool pool(thread_num);
+      start = steady_clock_t::now();
+      h.build(pool);
+      double ns = elapsed_ns(start);
+      std::printf("%-14s %8d %10zu %8zu %12.3f %12.3f %8.2f %6s\n",
+                  config,
+                  node_size,
+                  slot_size,
+                  thread_num,
+                  base_ns / 1e6,
+                  ns / 1e6,
+                  base_ns / ns,
+                  h.slot_array() == slots ? "yes" : "NO");
+    }
+  });
+}
+
+}  // namespace
+
+// Time build() for unweighted, slot counted and weighted hashers over node
+// sizes, slot sizes and weight skews (max weight / min weight).
+MAGLEV_BENCHMARK(hasher_build) {
+  std::vector<int>          node_sizes = {10, 100, 1000, 10000, 100000};
+  std::vector<size_t>       slot_sizes = {65537, 1000003, 4000037, 16777259};
+  std::vector<unsigned int> skews      = {1, 10, 100, 1000};
+  if (opt.quick) {
+    node_sizes = {10, 1000};
+    slot_sizes = {65537, 1000003};
+    skews      = {1, 100};
+  }
+  std::printf("%-14s %8s %10s %6s %12s %10s %12s %10s\n",
+              "config",
+              "nodes",
+              "slots",
+              "skew",
+              "build_ms",
+              "ns/slot",
+              "peak_rss_mb",
+              "imbalance");
+  for (size_t slot_size : slot_sizes) {
+    for (int node_size : node_sizes) {
+      // too few slots per node to be balanced
+      if (slot_size < size_t(node_size) * 10) continue;
+      build_case<unweighted_hasher_t>(
+          opt, "unweighted", node_size, slot_size, 1);
+      build_case<slot_counted_hasher_t>(
+          opt, "slot_counted", node_size, slot_size, 1);
+      for (unsigned int skew : skews) {
+        build_case<weighted_hasher_t>(
+            opt, "weighted", node_size, slot_size, skew);
+      }
+    }
+  }
+}
+
+// Time build(thread_pool) over thread numbers, against build() on one
+// thread. Speedup is bounded by the sequential resolving of turns, and is
+// meaningless if the machine has fewer cores than threads.
+MAGLEV_BENCHMARK(build_parallel) {
+  std::vector<int>    node_sizes = {100, 1000, 10000};
+  std::vector<size_t> slot_sizes = {1000003, 16777259};
+  if (opt.quick) {
+    node_sizes = {1000};
+    slot_sizes = {1000003};
+  }
+  std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+  std::printf("%-14s %8s %10s %8s %12s %12s %8s %6s\n",
+              "config",
+              "nodes",
+              "slots",
+              "threads",
+              "seq_ms",
+              "build_ms",
+              "speedup",
+              "same");
+  for (size_t slot_size : slot_sizes) {
+    for (int node_size : node_sizes) {
+      build_parallel_case<unweighted_hasher_t>(
+          opt, "unweighted", node_size, slot_size, 1);
+      build_parallel_case<weighted_hasher_t>(
+          opt, "weighted", node_size, slot_size, 10);
+    }
+  }
+}
+
+}  // namespace maglev_benchmark
@@ -0,0 +1,225 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <algorithm>
+#include <memory>
+#include <random>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+using server_node_t =
+    maglev::load_stats_wrapper<maglev::node_base<int>,
+                               maglev::server_load_stats_wrapper<>>;
+
+using server_balancer_t = maglev::maglev_balancer<
+    maglev::maglev_hasher<server_node_t, maglev::slot_vector<>>>;
+
+using arena_server_balancer_t = maglev::maglev_balancer<
+    maglev::maglev_hasher<server_node_t,
+                          maglev::slot_vector<>,
+                          maglev::arena_node_manager<server_node_t>>>;
+
+// Random queries of a heartbeat period to each node, heartbeat does not need
+// a built hasher.
+template <typename BalancerType>
+void feed(BalancerType& b, std::mt19937& rng) {
+  for (const auto& n : b.node_manager()) {
+    unsigned int q   = 10 + rng() % 100;
+    unsigned int e   = rng() % (q / 5);
+    unsigned int f   = rng() % 100 == 0 ? e : 0;
+    unsigned int lat = q * (100 + rng() % 50);
+    n->incr_load(q);
+    b.global_load().incr_load(q);
+    n->incr_server_load(q, e, f, lat);
+    b.global_load().incr_server_load(q, e, f, lat);
+  }
+}
+
+// Nodes are created among other allocations of random sizes, as in a long
+// running process, where separately allocated nodes are scattered.
+template <typename BalancerType>
+void heartbeat_case(const options& opt,
+                    const char*    mode,
+                    int            node_size,
+                    bool           top_k_rank) {
+  run_case(opt, [&]() {
+    BalancerType b;
+    b.balance_strategy().top_k_rank = top_k_rank;
+    std::mt19937                         rng(12345);
+    std::vector<std::unique_ptr<char[]>> others;
+    for (int i = 0; i < node_size; ++i) {
+      b.node_manager().new_back(i);
+      for (int j = 0; j < 4; ++j) others.emplace_back(new char[rng() % 512]);
+    }
+
+    const int heartbeat_size = opt.quick ? 5 : 20;
+    double    ns             = 0;
+    for (int t = 0; t < heartbeat_size; ++t) {
+      feed(b, rng);
+      auto start = steady_clock_t::now();
+      b.heartbeat();
+      ns += elapsed_ns(start);
+    }
+    std::printf("%-12s %8d %14.3f %12.1f %8d\n",
+                mode,
+                node_size,
+                ns / heartbeat_size / 1e6,
+                ns / heartbeat_size / node_size,
+                b.banned_cnt());
+  });
+}
+
+using load_node_t =
+    maglev::load_stats_wrapper<maglev::node_base<int>,
+                               maglev::load_stats<size_t, 8>>;
+
+// Heartbeat of load stats of each node after some of other allocations are
+// freed, i.e. as after churn, best of some rounds.
+template <typename NodeManagerType>
+void node_scan_case(const options& opt, const char* mode, int node_size) {
+  run_case(opt, [&]() {
+    NodeManagerType                      nm;
+    std::mt19937                         rng(12345);
+    std::vector<std::unique_ptr<char[]>> others;
+    for (int i = 0; i < node_size; ++i) {
+      nm.new_back(i);
+      for (int j = 0; j < 4; ++j) others.emplace_back(new char[rng() % 512]);
+    }
+    std::shuffle(others.begin(), others.end(), rng);
+    others.resize(others.size() / 2);
+
+    double best = 0;
+    size_t sum  = 0;
+    for (int t = 0; t < (opt.quick ? 5 : 20); ++t) {
+      for (const auto& n : nm) n->incr_load(rng() % 100);
+      auto start = steady_clock_t::now();
+      for (const auto& n : nm) {
+        n->heartbeat();
+        sum += n->load().last();
+      }
+      double ns = elapsed_ns(start);
+      best      = t == 0 ? ns : std::min(best, ns);
+    }
+    std::printf("%-12s %8d %12.2f %14zu\n",
+                mode,
+                node_size,
+                best / node_size,
+                sum);
+  });
+}
+
+// Servers of vnode_cnt virtual nodes each, either as vnode_cnt nodes of their
+// own stats as created by hand, or as one node expanded in the slot table.
+void vnode_case(const options& opt,
+                int            server_size,
+                int            vnode_cnt,
+                bool           expanded) {
+  run_case(opt, [&]() {
+    server_balancer_t b;
+    b.slot_array().resize(
+        maglev::slot_size_for(server_size * vnode_cnt, 0.1));
+    if (expanded) {
+      b.node_manager().set_vnode_cnt(vnode_cnt);
+      for (int i = 0; i < server_size; ++i) b.node_manager().new_back(i);
+    } else {
+      for (int i = 0; i < server_size * vnode_cnt; ++i) {
+        b.node_manager().new_back(i);
+      }
+    }
+    auto start = steady_clock_t::now();
+    b.build();
+    double build_ns = elapsed_ns(start);
+
+    std::mt19937 rng(12345);
+    const int    heartbeat_size = opt.quick ? 5 : 20;
+    double       ns             = 0;
+    for (int t = 0; t < heartbeat_size; ++t) {
+      feed(b, rng);
+      start = steady_clock_t::now();
+      b.heartbeat();
+      ns += elapsed_ns(start);
+    }
+    std::printf("%-10s %8d %6d %10zu %10.3f %14.3f %12.1f\n",
+                expanded ? "vnode_cnt" : "by_hand",
+                server_size,
+                vnode_cnt,
+                b.node_size(),
+                build_ns / 1e6,
+                ns / heartbeat_size / 1e6,
+                peak_rss_kb() / 1024.0);
+  });
+}
+
+}  // namespace
+
+// Time of balancer heartbeat on server_load_stats, ranking nodes by full sorts
+// or by top k selection, with nodes allocated separately or in an arena.
+MAGLEV_BENCHMARK(heartbeat) {
+  std::vector<int> node_sizes = {100, 1000, 10000, 100000};
+  if (opt.quick) node_sizes = {100, 10000};
+  std::printf("%-12s %8s %14s %12s %8s\n",
+              "mode",
+              "nodes",
+              "heartbeat_ms",
+              "ns/node",
+              "banned");
+  for (int node_size : node_sizes) {
+    heartbeat_case<server_balancer_t>(opt, "full_sort", node_size, false);
+    heartbeat_case<server_balancer_t>(opt, "top_k", node_size, true);
+    heartbeat_case<arena_server_balancer_t>(
+        opt, "top_k_arena", node_size, true);
+  }
+}
+
+// Heartbeat of nodes of small stats, with nodes allocated separately or in an
+// arena.
+MAGLEV_BENCHMARK(node_scan) {
+  std::vector<int> node_sizes = {1000, 100000, 1000000};
+  if (opt.quick) node_sizes = {1000, 100000};
+  std::printf("%-12s %8s %12s %14s\n", "mode", "nodes", "ns/node", "check");
+  for (int node_size : node_sizes) {
+    node_scan_case<maglev::node_manager_base<load_node_t>>(
+        opt, "default", node_size);
+    node_scan_case<maglev::arena_node_manager<load_node_t>>(
+        opt, "arena", node_size);
+  }
+}
+
+// Build and heartbeat of servers of virtual nodes, with virtual nodes created
+// by hand or by vnode_cnt of the node manager.
+MAGLEV_BENCHMARK(vnode) {
+  std::vector<int> server_sizes = {100, 1000, 10000};
+  std::vector<int> vnode_cnts   = {4, 16};
+  if (opt.quick) server_sizes = {1000};
+  std::printf("%-10s %8s %6s %10s %10s %14s %12s\n",
+              "mode",
+              "servers",
+              "vnodes",
+              "nodes",
+              "build_ms",
+              "heartbeat_ms",
+              "peak_rss_mb");
+  for (int server_size : server_sizes) {
+    for (int vnode_cnt : vnode_cnts) {
+      vnode_case(opt, server_size, vnode_cnt, false);
+      vnode_case(opt, server_size, vnode_cnt, true);
+    }
+  }
+}
+
+}  // namespace maglev_benchmark
@@ -0,0 +1,137 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <string>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+using node_manager_t = maglev::node_manager_base<maglev::node_base<>>;
+
+// Ids as of service discovery, e.g. "10.1.2.3:8080".
+std::string id_of(int i) {
+  return "10." + std::to_string(i / 65536) + "." +
+         std::to_string(i / 256 % 256) + "." + std::to_string(i % 256) +
+         ":8080";
+}
+
+// Time ready_go() of shuffled nodes, then find all ids by the id index or,
+// if not indexed, by binary search as sort() leaves it.
+void node_lookup_case(const options& opt, int node_size, bool indexed) {
+  run_case(opt, [&]() {
+    std::vector<std::string> ids;
+    for (int i = 0; i < node_size; ++i) ids.push_back(id_of(i));
+    node_manager_t nm;
+    for (int i = 0; i < node_size; ++i) {
+      nm.new_back(ids[size_t(i) * 7919 % ids.size()]);
+    }
+
+    auto begin = steady_clock_t::now();
+    if (indexed) {
+      nm.ready_go();
+    } else {
+      nm.sort();
+    }
+    double ready_ns = elapsed_ns(begin);
+
+    const int rounds = opt.quick ? 2 : 20;
+    size_t    check  = 0;
+    begin            = steady_clock_t::now();
+    for (int r = 0; r < rounds; ++r) {
+      for (const auto& id : ids) check += nm.find_idx_by_node_id(id);
+    }
+    double find_ns = elapsed_ns(begin) / (double(rounds) * ids.size());
+    std::printf("%-10s %8d %12.3f %10.1f %14zu\n",
+                indexed ? "id_index" : "binary",
+                node_size,
+                ready_ns / 1e6,
+                find_ns,
+                check);
+  });
+}
+
+// Time to make a ready node manager of a full node list in which changed_cnt
+// nodes are replaced by new ones, by apply_membership() or from scratch.
+void membership_case(const options& opt, int node_size, int changed_cnt) {
+  run_case(opt, [&]() {
+    node_manager_t nm;
+    for (int i = 0; i < node_size; ++i) nm.new_back(id_of(i));
+    nm.ready_go();
+
+    std::vector<node_manager_t::item_t> list;
+    for (int i = 0; i < node_size; ++i) {
+      int k = int(size_t(i) * 7919 % node_size);  // shuffled
+      list.push_back(nm.new_node(id_of(k < changed_cnt ? node_size + k : k)));
+    }
+
+    auto begin = steady_clock_t::now();
+    {
+      node_manager_t fresh;
+      for (const auto& n : list) fresh.new_back(n->id());
+      fresh.ready_go();
+    }
+    double scratch_ns = elapsed_ns(begin);
+
+    begin           = steady_clock_t::now();
+    bool   changed  = nm.apply_membership(list);
+    double apply_ns = elapsed_ns(begin);
+    std::printf("%-10s %8d %8d %12.3f %12.3f\n",
+                changed ? "changed" : "unchanged",
+                node_size,
+                changed_cnt,
+                scratch_ns / 1e6,
+                apply_ns / 1e6);
+  });
+}
+
+}  // namespace
+
+// Time to get nodes ready and to find nodes by string ids, with or without
+// the id index built by ready_go().
+MAGLEV_BENCHMARK(node_lookup) {
+  std::vector<int> node_sizes = {100, 1000, 10000, 50000};
+  if (opt.quick) node_sizes = {1000, 50000};
+  std::printf("%-10s %8s %12s %10s %14s\n",
+              "mode",
+              "nodes",
+              "ready_ms",
+              "ns/find",
+              "check");
+  for (int node_size : node_sizes) {
+    node_lookup_case(opt, node_size, false);
+    node_lookup_case(opt, node_size, true);
+  }
+}
+
+// Time to apply a full node list of service discovery to a ready node manager
+// by apply_membership(), or to make a new node manager of it.
+MAGLEV_BENCHMARK(apply_membership) {
+  std::vector<int> node_sizes = {1000, 10000, 50000};
+  if (opt.quick) node_sizes = {50000};
+  std::printf("%-10s %8s %8s %12s %12s\n",
+              "list",
+              "nodes",
+              "changed",
+              "scratch_ms",
+              "apply_ms");
+  for (int node_size : node_sizes) {
+    membership_case(opt, node_size, 0);
+    membership_case(opt, node_size, node_size / 100);
+  }
+}
+
+}  // namespace maglev_benchmark
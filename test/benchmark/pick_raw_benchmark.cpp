@@ -0,0 +1,96 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <atomic>
+#include <thread>
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+using balancer_t = maglev::maglev_balancer<maglev::maglev_hasher<
+    maglev::load_stats_wrapper<maglev::node_base<int>, maglev::load_stats<>>,
+    maglev::slot_vector<>>>;
+
+// Threads pick keys of a few hot nodes, so that threads contend on reference
+// counts of the same nodes with pick(), and only read them with pick_raw().
+void pick_raw_case(const options& opt, int thread_size, bool raw) {
+  run_case(opt, [&]() {
+    balancer_t b;
+    b.slot_array().resize(65537);
+    for (int i = 0; i < 100; ++i) b.node_manager().new_back(i);
+    b.build();
+    b.heartbeat();
+
+    const size_t      pick_size = opt.quick ? 200000 : 2000000;
+    std::atomic<int>  ready{0};
+    std::atomic<bool> start{false};
+    std::atomic<long> check{0};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_size; ++t) {
+      threads.emplace_back([&, t]() {
+        ++ready;
+        while (!start) std::this_thread::yield();
+        long sum = 0;
+        for (size_t i = 0; i < pick_size; ++i) {
+          size_t k = maglev::def_hash_t<size_t>{}(i % 4);  // hot keys
+          if (raw) {
+            maglev::epoch_guard guard;
+            sum += b.pick_raw(k).node->id();
+          } else {
+            sum += b.pick(k).node->id();
+          }
+        }
+        check += sum;
+      });
+    }
+    while (ready != thread_size) std::this_thread::yield();
+    auto begin = steady_clock_t::now();
+    start      = true;
+    for (auto& t : threads) t.join();
+    double ns = elapsed_ns(begin);
+
+    double pick_cnt = double(pick_size) * thread_size;
+    std::printf("%-10s %8d %14.0f %10.2f %14ld\n",
+                raw ? "pick_raw" : "pick",
+                thread_size,
+                pick_cnt / ns * 1e9,
+                ns / pick_cnt,
+                check.load());
+  });
+}
+
+}  // namespace
+
+// Picks per second of threads picking hot keys, by pick() copying node
+// pointers or by pick_raw() within an epoch_guard.
+MAGLEV_BENCHMARK(pick_raw) {
+  std::vector<int> thread_sizes = {1, 2, 4, 8, 16, 32, 64};
+  if (opt.quick) thread_sizes = {1, 4, 16};
+  std::printf("%-10s %8s %14s %10s %14s\n",
+              "mode",
+              "threads",
+              "picks/s",
+              "ns/pick",
+              "check");
+  for (int thread_size : thread_sizes) {
+    pick_raw_case(opt, thread_size, false);
+    pick_raw_case(opt, thread_size, true);
+  }
+}
+
+}  // namespace maglev_benchmark
@@ -0,0 +1,103 @@
+// Copyright (c) 2021-2022 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "benchmark.h"
+
+namespace maglev_benchmark {
+
+namespace {
+
+// Balance nodes with load of now at least overload, regardless of others.
+struct overload_strategy : public maglev::default_balance_strategy {
+  unsigned long long overload = 1;
+
+  template <typename StatsTypeA, typename StatsTypeB>
+  bool should_balance(const StatsTypeA& n,
+                      const StatsTypeB& g,
+                      size_t            node_size) const {
+    return n.load().now() >= overload;
+  }
+};
+
+using balancer_t = maglev::maglev_balancer<
+    maglev::maglev_hasher<
+        maglev::load_stats_wrapper<maglev::node_base<int>,
+                                   maglev::load_stats<>>,
+        maglev::slot_vector<>>,
+    overload_strategy>;
+
+void retry_case(const options& opt,
+                int            node_size,
+                int            overloaded_pct,
+                bool           node_distinct) {
+  run_case(opt, [&]() {
+    balancer_t b;
+    b.balance_strategy().node_distinct_retry = node_distinct;
+    b.slot_array().resize(65537);
+    for (int i = 0; i < node_size; ++i) b.node_manager().new_back(i);
+    b.build();
+    // overload the first nodes, which are spread over slots as others
+    int overloaded = node_size * overloaded_pct / 100;
+    for (int i = 0; i < overloaded; ++i) b.node_manager()[i]->incr_load(1);
+
+    // Pick until 1M picks or the time limit, all overloaded is very slow by
+    // probing slots.
+    const double max_ns    = opt.quick ? 5e7 : 5e8;
+    size_t       pick_cnt  = 0;
+    size_t       retry_sum = 0, failed_cnt = 0;
+    auto         start     = steady_clock_t::now();
+    double       ns        = 0;
+    while (pick_cnt < 1000000 && (pick_cnt % 64 != 0 || ns < max_ns)) {
+      auto ret = b.pick(maglev::def_hash_t<size_t>{}(pick_cnt));
+      retry_sum += ret.retry_cnt;
+      failed_cnt += ret.failed;
+      ++pick_cnt;
+      if (pick_cnt % 64 == 0) ns = elapsed_ns(start);
+    }
+    ns = elapsed_ns(start);
+    std::printf("%-14s %6d %11d %10zu %12.1f %10.2f %10.4f\n",
+                node_distinct ? "node_distinct" : "rehash",
+                node_size,
+                overloaded_pct,
+                pick_cnt,
+                ns / pick_cnt,
+                double(retry_sum) / pick_cnt,
+                double(failed_cnt) / pick_cnt);
+  });
+}
+
+}  // namespace
+
+// Pick latency when some or all nodes are overloaded, retrying by probing
+// slots or by a node distinct sequence.
+MAGLEV_BENCHMARK(retry) {
+  std::vector<int> node_sizes = {10, 100, 1000};
+  if (opt.quick) node_sizes = {10, 100};
+  std::printf("%-14s %6s %11s %10s %12s %10s %10s\n",
+              "mode",
+              "nodes",
+              "overloaded%",
+              "picks",
+              "ns/pick",
+              "avg_retry",
+              "failed");
+  for (int node_size : node_sizes) {
+    for (int pct : {0, 30, 60, 100}) {
+      retry_case(opt, node_size, pct, false);
+      retry_case(opt, node_size, pct, true);
+    }
+  }
+}
+
+}  // namespace maglev_benchmark
@@ -12,7 +12,10 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#include <atomic>
+#include <chrono>
 #include <numeric>
+#include <thread>
 
 #include "performance_test.h"
 
@@ -65,4 +68,128 @@ TEST(maglev_balancer, maglev_balancer_weighted_server_stats) {
                         i->query().avg() / i->weight(),
                         i->load().avg()));
   }
-}
\ No newline at end of file
+}
+
+namespace {
+
+std::atomic<int> live_hasher_cnt{0};
+
+// A hasher which is marked dead on destruction, to catch use after free.
+using checked_hasher_base_t = maglev::maglev_hasher<
+    maglev::load_stats_wrapper<maglev::node_base<int>, maglev::load_stats<>>,
+    maglev::slot_array<int, 5003>>;
+
+struct checked_hasher : public checked_hasher_base_t {
+  checked_hasher() { ++live_hasher_cnt; }
+  checked_hasher(const checked_hasher& r)
+      : checked_hasher_base_t(static_cast<const checked_hasher_base_t&>(r)) {
+    ++live_hasher_cnt;
+  }
+  ~checked_hasher() {
+    alive = false;
+    --live_hasher_cnt;
+  }
+
+  volatile bool alive = true;
+};
+
+}  // namespace
+
+TEST(maglev_balancer, set_maglev_hasher_stress) {
+  checked_hasher tables[2];
+  for (int t = 0; t < 2; ++t) {
+    for (int i = 0; i < 20; ++i) tables[t].node_manager().new_back(i + t * 10);
+    tables[t].build();
+  }
+  maglev::maglev_balancer<checked_hasher> b(new checked_hasher(tables[0]));
+
+  const auto          duration = std::chrono::milliseconds(1000);
+  std::atomic<bool>   stop{false};
+  std::atomic<size_t> pick_cnt{0}, bad_cnt{0};
+  std::vector<std::thread> pickers;
+  for (int t = 0; t < 3; ++t) {
+    pickers.emplace_back([&, t]() {
+      size_t cnt = 0, bad = 0;
+      for (size_t k = t; !stop.load(std::memory_order_relaxed); k += 3) {
+        maglev::epoch_guard g;
+        const auto&         h   = b.maglev_hasher();
+        auto                ret = b.pick(maglev::def_hash_t<size_t>{}(k));
+        bad += !h.alive || !ret.node || ret.node->id() < 0 ||
+               ret.node->id() >= 30;
+        ++cnt;
+      }
+      pick_cnt += cnt;
+      bad_cnt += bad;
+    });
+  }
+
+  size_t swap_cnt = 0;
+  auto   start    = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < duration) {
+    b.set_maglev_hasher(new checked_hasher(tables[++swap_cnt % 2]));
+  }
+  stop = true;
+  for (auto& t : pickers) t.join();
+  maglev::epoch_domain::global().collect();
+  maglev::epoch_domain::global().collect();
+
+  std::cout << "set_maglev_hasher stress: " << swap_cnt << " swaps and "
+            << pick_cnt << " picks in " << duration.count() << "ms"
+            << std::endl;
+  EXPECT_EQ(bad_cnt, 0);
+  EXPECT_GT(swap_cnt, 1000);
+  // tables, the one in use, and retired ones all reclaimed
+  EXPECT_EQ(live_hasher_cnt, 3);
+}
+
+TEST(maglev_balancer, heartbeat_thread_stress) {
+  maglev::maglev_balancer<maglev::maglev_hasher<
+      maglev::load_stats_wrapper<maglev::node_base<int>,
+                                 maglev::server_load_stats_wrapper<>>>>
+      b;
+  b.balance_strategy().precomputed_verdict = true;
+  b.balance_strategy().top_k_rank          = true;
+  for (int i = 0; i < 30; ++i) b.node_manager().new_back(i);
+  b.build();
+
+  std::atomic<bool>   stop{false};
+  std::atomic<size_t> pick_cnt{0};
+  std::vector<std::thread> pickers;
+  for (int t = 0; t < 3; ++t) {
+    pickers.emplace_back([&, t]() {
+      size_t cnt = 0;
+      for (size_t k = t; !stop.load(std::memory_order_relaxed); k += 3) {
+        auto ret   = b.pick(maglev::def_hash_t<size_t>{}(k % 1000));
+        bool fatal = ret.node->id() == 3;
+        ret.node->incr_load();
+        b.global_load().incr_load();
+        ret.node->incr_server_load(1, fatal, fatal, 100);
+        b.global_load().incr_server_load(1, fatal, fatal, 100);
+        ++cnt;
+      }
+      pick_cnt += cnt;
+    });
+  }
+
+  // Heartbeat in its own thread, fewer times than the window size so that
+  // window sums keep all points.
+  int heartbeat_cnt = 0;
+  for (; heartbeat_cnt < 50; ++heartbeat_cnt) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    b.heartbeat();
+  }
+  stop = true;
+  for (auto& t : pickers) t.join();
+
+  // No increment is lost by heartbeats.
+  const auto& g = b.global_load();
+  EXPECT_EQ(g.load().sum() + g.load().now(), pick_cnt);
+  size_t node_sum = 0;
+  for (const auto& n : b.node_manager()) {
+    node_sum += n->load().sum() + n->load().now();
+  }
+  EXPECT_EQ(node_sum, pick_cnt);
+  std::cout << "heartbeat thread stress: " << heartbeat_cnt
+            << " heartbeats and " << pick_cnt << " picks, "
+            << b.banned_cnt() << " banned" << std::endl;
+}
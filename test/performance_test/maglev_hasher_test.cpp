@@ -12,6 +12,7 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#include <chrono>
 #include <numeric>
 
 #include "performance_test.h"
@@ -154,3 +155,148 @@ TEST(maglev_hasher, maglev_hasher_weighted) {
                  double(hit_nums[i]) / maxhit);
   }
 }
+
+TEST(maglev_hasher, maglev_hasher_parallel_build) {
+  using hasher_t = maglev::maglev_hasher<maglev::node_base<int>,
+                                         maglev::slot_vector<>>;
+  hasher_t h1, h2;
+  h1.slot_array().resize(1000003);
+  h2.slot_array().resize(1000003);
+  for (int i = 0; i < 10000; ++i) {
+    h1.node_manager().new_back(i);
+    h2.node_manager().new_back(i);
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  h1.build();
+  auto t1 = std::chrono::steady_clock::now();
+  h2.build_parallel(4);
+  auto t2 = std::chrono::steady_clock::now();
+  EXPECT_EQ(h1.slot_array(), h2.slot_array());
+
+  auto ms = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  };
+  std::cout << "build 1000003 slots, 10000 nodes: sequential " << ms(t1 - t0)
+            << "ms, 4 threads " << ms(t2 - t1) << "ms" << std::endl;
+}
+
+// The build loop before occupancy bitmap: probe slot array for a sentinel
+// and step permutation by modulo.
+template <typename HasherType>
+void legacy_build(HasherType& h) {
+  auto& nm = h.node_manager();
+  auto& s  = h.slot_array();
+  nm.ready_go();
+  std::fill(s.begin(), s.end(), -1);
+  std::vector<std::pair<size_t, size_t>> p;  // offset, step
+  for (const auto& i : nm) {
+    maglev::permutation_generator g(h.slot_size(), i->id_hash());
+    p.emplace_back(g.offset(), g.step());
+  }
+  for (size_t node_idx = 0, cnt = 0; cnt < h.slot_size();) {
+    while (true) {
+      auto t            = p[node_idx].first;
+      p[node_idx].first = (t + p[node_idx].second) % h.slot_size();
+      if (s[t] == -1) {
+        s[t] = node_idx;
+        ++cnt;
+        break;
+      }
+    }
+    if (++node_idx >= nm.size()) node_idx = 0;
+  }
+}
+
+TEST(maglev_hasher, maglev_hasher_build_time) {
+  using hasher_t = maglev::maglev_hasher<maglev::node_base<int>,
+                                         maglev::slot_vector<>>;
+  auto us = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  };
+  for (size_t slot_size : {65537, 1000003, 4000037}) {
+    for (int node_size : {10, 1000}) {
+      hasher_t h1, h2;
+      h1.slot_array().resize(slot_size);
+      h2.slot_array().resize(slot_size);
+      for (int i = 0; i < node_size; ++i) {
+        h1.node_manager().new_back(i);
+        h2.node_manager().new_back(i);
+      }
+      auto t0 = std::chrono::steady_clock::now();
+      legacy_build(h1);
+      auto t1 = std::chrono::steady_clock::now();
+      h2.build();
+      auto t2 = std::chrono::steady_clock::now();
+      EXPECT_EQ(h1.slot_array(), h2.slot_array());
+      std::cout << "build " << slot_size << " slots, " << node_size
+                << " nodes: legacy " << us(t1 - t0) << "us, bitmap "
+                << us(t2 - t1) << "us" << std::endl;
+    }
+  }
+}
+
+template <typename SlotArrayType>
+void pick_latency_test(const char* name, int hasher_cnt, int node_size) {
+  using hasher_t = maglev::maglev_hasher<maglev::node_base<int>, SlotArrayType>;
+  std::vector<hasher_t> hashers(hasher_cnt);
+  for (auto& h : hashers) {
+    h.slot_array().resize(65537);
+    for (int i = 0; i < node_size; ++i) h.node_manager().new_back(i);
+    h.build();
+  }
+
+  const int pick_cnt = 1000000;
+  size_t    sum      = 0;
+  auto      t0       = std::chrono::steady_clock::now();
+  for (int i = 0; i < pick_cnt; ++i) {
+    size_t key = maglev::maglev_int_hash<int>{}(i);
+    sum += hashers[key % hasher_cnt].pick(key).node_idx;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  EXPECT_GT(sum, 0);
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0);
+  std::cout << "pick latency " << name << ", " << hasher_cnt << " hashers x "
+            << node_size << " nodes: " << double(ns.count()) / pick_cnt
+            << "ns" << std::endl;
+}
+
+TEST(maglev_hasher, maglev_hasher_slot_width) {
+  // 64 hashers: 16MB of int tables, 4MB of uint8 tables, beyond L2
+  pick_latency_test<maglev::slot_vector<int>>("int", 64, 200);
+  pick_latency_test<maglev::narrow_slot_vector<65536>>("uint16", 64, 200);
+  pick_latency_test<maglev::narrow_slot_vector<256>>("uint8", 64, 200);
+  pick_latency_test<maglev::packed_slot_vector<>>("packed", 64, 200);
+}
+
+TEST(maglev_hasher, maglev_hasher_pick_batch) {
+  using hasher_t = maglev::maglev_hasher<maglev::node_base<int>,
+                                         maglev::slot_vector<>>;
+  hasher_t h;
+  h.slot_array().resize(4000037);  // 16MB table
+  for (int i = 0; i < 10000; ++i) h.node_manager().new_back(i);
+  h.build();
+
+  const size_t        pick_cnt = 1 << 20;
+  std::vector<size_t> hashes(pick_cnt);
+  for (size_t i = 0; i < pick_cnt; ++i) {
+    hashes[i] = maglev::maglev_int_hash<size_t>{}(i);
+  }
+  std::vector<hasher_t::pick_ret_t> r1(pick_cnt), r2(pick_cnt);
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < pick_cnt; ++i) r1[i] = h.pick(hashes[i]);
+  auto t1 = std::chrono::steady_clock::now();
+  for (size_t b = 0; b < pick_cnt; b += 64) {
+    h.pick_batch(hashes.data() + b, 64, r2.data() + b);
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < pick_cnt; ++i) EXPECT_EQ(r1[i].node, r2[i].node);
+
+  auto mps = [&](std::chrono::steady_clock::duration d) {
+    return pick_cnt / std::chrono::duration<double, std::micro>(d).count();
+  };
+  std::cout << "pick throughput, 4000037 slots x 10000 nodes: scalar "
+            << mps(t1 - t0) << "M/s, batch of 64 " << mps(t2 - t1) << "M/s"
+            << std::endl;
+}
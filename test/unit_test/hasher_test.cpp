@@ -13,8 +13,10 @@
 // the License.
 
 #include <climits>
+#include <cmath>
 #include <numeric>
 
+#include "maglev/hasher/snapshot.h"
 #include "unit_test.h"
 
 TEST(hasher, slot_array) {
@@ -294,3 +296,945 @@ TEST(hasher, default_balance_strategy) {
     }
   }
 }
+
+TEST(hasher, maglev_hasher_rebuild) {
+  using hasher_t = maglev::maglev_hasher<
+      maglev::slot_counted_node_wrapper<maglev::node_base<int>>,
+      maglev::slot_array<int, 5003>>;
+  hasher_t h;
+  for (int i = 0; i < 10; ++i) { h.node_manager().new_back(i); }
+  h.build();
+
+  // nothing changed
+  hasher_t::membership_delta_t delta;
+  delta.remove.push_back(100);
+  auto r = h.diff_rebuild(delta);
+  EXPECT_FALSE(r.rebuilt);
+  EXPECT_EQ(r.moved_slot_cnt, 0);
+
+  delta.remove = {3, 7};
+  delta.add.push_back(h.node_manager().new_node(10));
+  delta.add.push_back(h.node_manager().new_node(11));
+  hasher_t h2;
+  r = h2.diff_rebuild_from(h, delta);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_GT(r.moved_slot_cnt, 0);
+  EXPECT_LT(r.moved_slot_cnt, h.slot_size() / 2);
+  EXPECT_EQ(h2.node_size(), 10);
+  EXPECT_EQ(h2.node_manager().find_by_node_id(3), nullptr);
+  EXPECT_EQ(h2.node_manager().find_by_node_id(0),
+            h.node_manager().find_by_node_id(0));
+
+  hasher_t h3;
+  for (int i : {0, 1, 2, 4, 5, 6, 8, 9, 10, 11}) {
+    h3.node_manager().new_back(i);
+  }
+  h3.build();
+  EXPECT_EQ(h2.slot_array(), h3.slot_array());
+
+  // In-place rebuild
+  r = h.diff_rebuild(delta);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_EQ(h.slot_array(), h3.slot_array());
+
+  // slot counts of shared nodes are of the last build
+  int cnt_sum = 0;
+  for (const auto& n : h.node_manager()) cnt_sum += n->slot_cnt();
+  EXPECT_EQ(cnt_sum, h.slot_size());
+
+  // adds of ids in use are ignored
+  hasher_t::membership_delta_t dup;
+  dup.add.push_back(h.node_manager().new_node(0));
+  r = h.diff_rebuild(dup);
+  EXPECT_FALSE(r.rebuilt);
+  dup.add.push_back(h.node_manager().new_node(12));
+  dup.add.push_back(h.node_manager().new_node(12));
+  r = h.diff_rebuild(dup);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_EQ(h.node_size(), 11);
+}
+
+TEST(hasher, maglev_hasher_rebuild_weighted) {
+  using hasher_t = maglev::maglev_hasher<
+      maglev::weighted_node_wrapper<maglev::node_base<int>>,
+      maglev::slot_array<int, 5003>>;
+  hasher_t h;
+  for (int i = 0; i < 10; ++i) {
+    h.node_manager().new_back(i)->set_weight(10 + i);
+  }
+  h.build();
+
+  hasher_t::membership_delta_t delta;
+  delta.reweight.emplace_back(2, 12);  // same weight
+  auto r = h.diff_rebuild(delta);
+  EXPECT_FALSE(r.rebuilt);
+
+  delta.reweight.emplace_back(5, 100);
+  const auto prev_slots = h.slot_array();
+  hasher_t   h1;
+  r = h1.diff_rebuild_from(h, delta);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_GT(r.moved_slot_cnt, 0);
+  // nodes are shared and reweighted in place, prev's slot array is unchanged
+  EXPECT_EQ(h1.node_manager().find_by_node_id(5),
+            h.node_manager().find_by_node_id(5));
+  EXPECT_EQ(h.node_manager().find_by_node_id(5)->weight(), 100);
+  EXPECT_EQ(h.slot_array(), prev_slots);
+
+  hasher_t h2;
+  for (int i = 0; i < 10; ++i) {
+    h2.node_manager().new_back(i)->set_weight(i == 5 ? 100 : 10 + i);
+  }
+  h2.build();
+  EXPECT_EQ(h1.slot_array(), h2.slot_array());
+
+  // in place, back to the old weight
+  delta.reweight = {{5, 15}};
+  r = h.diff_rebuild(delta);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_EQ(r.moved_slot_cnt, 0);
+  EXPECT_EQ(h.slot_array(), prev_slots);
+}
+
+TEST(hasher, maglev_hasher_reweight_keeps_stats) {
+  using node_t = maglev::load_stats_wrapper<
+      maglev::weighted_node_wrapper<maglev::server_node_base<>>,
+      maglev::server_load_stats_wrapper<>>;
+  using hasher_t = maglev::maglev_hasher<node_t>;
+  hasher_t h;
+  for (int i = 0; i < 10; ++i) {
+    h.node_manager().new_back("10.0.0." + std::to_string(i), 80);
+  }
+  for (const auto& n : h.node_manager()) n->set_weight(10);
+  h.build();
+  auto n = h.node_manager().find_by_node_id("10.0.0.3:80");
+  ASSERT_NE(n, nullptr);
+  n->incr_load();
+  n->incr_server_load(3, true, false, 100);
+  n->incr_consecutive_ban_cnt();
+  const auto load = n->load().now();
+
+  std::vector<hasher_t::node_manager_item_t> list;
+  for (int i = 0; i < 10; ++i) {
+    list.push_back(
+        h.node_manager().new_node("10.0.0." + std::to_string(i), 80));
+    list.back()->set_weight(i == 3 ? 30 : 10);
+  }
+  auto r = h.apply_membership(list);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_GT(r.moved_slot_cnt, 0);
+  EXPECT_EQ(h.node_manager().find_by_node_id("10.0.0.3:80"), n);
+  EXPECT_EQ(n->weight(), 30);
+  EXPECT_EQ(n->ip(), "10.0.0.3");
+  EXPECT_EQ(n->port(), 80);
+  EXPECT_EQ(n->load().now(), load);
+  EXPECT_EQ(n->query().now(), 3);
+  EXPECT_EQ(n->error().now(), 1);
+  EXPECT_EQ(n->consecutive_ban_cnt(), 1);
+}
+
+TEST(hasher, maglev_hasher_apply_membership) {
+  using hasher_t = maglev::maglev_hasher<
+      maglev::weighted_node_wrapper<maglev::node_base<int>>,
+      maglev::slot_array<int, 5003>>;
+  hasher_t h;
+  for (int i = 0; i < 10; ++i) {
+    h.node_manager().new_back(i)->set_weight(10 + i);
+  }
+  h.build();
+  auto n0 = h.node_manager().find_by_node_id(0);
+
+  // the same list of new node objects
+  std::vector<hasher_t::node_manager_item_t> list;
+  for (int i = 9; i >= 0; --i) {
+    list.push_back(h.node_manager().new_node(i));
+    list.back()->set_weight(10 + i);
+  }
+  auto r = h.apply_membership(list);
+  EXPECT_FALSE(r.rebuilt);
+
+  list.erase(list.begin());  // 9
+  list.push_back(h.node_manager().new_node(10));
+  list.back()->set_weight(20);
+  list[0]->set_weight(100);  // 8
+  r = h.apply_membership(list);
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_GT(r.moved_slot_cnt, 0);
+  EXPECT_EQ(h.node_size(), 10);
+  EXPECT_EQ(h.node_manager().find_by_node_id(0), n0);  // node kept
+  EXPECT_EQ(h.node_manager().find_by_node_id(8)->weight(), 100);
+
+  hasher_t h2;
+  for (int i : {0, 1, 2, 3, 4, 5, 6, 7, 8, 10}) {
+    h2.node_manager().new_back(i)->set_weight(i == 8 ? 100 : 10 + i);
+  }
+  h2.build();
+  EXPECT_EQ(h.slot_array(), h2.slot_array());
+}
+
+TEST(hasher, maglev_hasher_parallel_build) {
+  maglev::thread_pool pool(4);
+  {
+    maglev::maglev_hasher<
+        maglev::slot_counted_node_wrapper<maglev::node_base<int>>,
+        maglev::slot_vector<>>
+        h1, h2;
+    h1.slot_array().resize(50021);
+    h2.slot_array().resize(50021);
+    for (int i = 0; i < 300; ++i) {
+      h1.node_manager().new_back(i);
+      h2.node_manager().new_back(i);
+    }
+    h1.build();
+    h2.build(pool);
+    EXPECT_EQ(h1.slot_array(), h2.slot_array());
+    for (int i = 0; i < 300; ++i) {
+      EXPECT_EQ(h1.node_manager()[i]->slot_cnt(),
+                h2.node_manager()[i]->slot_cnt());
+    }
+  }
+  {
+    maglev::maglev_hasher<maglev::weighted_node_wrapper<maglev::node_base<int>>,
+                          maglev::slot_array<int, 5003>>
+        h1, h2;
+    for (int i = 0; i < 50; ++i) {
+      h1.node_manager().new_back(i)->set_weight(10 + i % 7 * 20);
+      h2.node_manager().new_back(i)->set_weight(10 + i % 7 * 20);
+    }
+    h1.build();
+    h2.build(pool);
+    EXPECT_EQ(h1.slot_array(), h2.slot_array());
+    h2.build_parallel(3);
+    EXPECT_EQ(h1.slot_array(), h2.slot_array());
+  }
+  {
+    // few slots per vnode, so candidates found ahead are often taken
+    maglev::maglev_hasher<maglev::node_base<int>, maglev::slot_vector<>> h1,
+        h2;
+    h1.slot_array().resize(1009);
+    h2.slot_array().resize(1009);
+    h1.node_manager().set_vnode_cnt(4);
+    h2.node_manager().set_vnode_cnt(4);
+    for (int i = 0; i < 25; ++i) {
+      h1.node_manager().new_back(i);
+      h2.node_manager().new_back(i);
+    }
+    h1.build();
+    h2.build(pool);
+    EXPECT_EQ(h1.slot_array(), h2.slot_array());
+  }
+}
+
+TEST(hasher, vnode) {
+  using hasher_t = maglev::maglev_hasher<
+      maglev::weighted_node_wrapper<
+          maglev::slot_counted_node_wrapper<maglev::node_base<int>>>,
+      maglev::slot_array<int, 5003>>;
+  hasher_t h0, h1, h2, h3;
+  h1.node_manager().set_vnode_cnt(1);
+  h2.node_manager().set_vnode_cnt(8);
+  h3.node_manager().set_vnode_cnt(8);
+  h3.set_exact_quota(true);
+  for (int i = 0; i < 20; ++i) {
+    h0.node_manager().new_back(i)->set_weight(10 + i % 3 * 10);
+    h1.node_manager().new_back(i)->set_weight(10 + i % 3 * 10);
+    h2.node_manager().new_back(i)->set_weight(10 + i % 3 * 10);
+    h3.node_manager().new_back(i)->set_weight(10 + i % 3 * 10);
+  }
+  h0.build();
+  h1.build();
+  h2.build();
+  h3.build();
+  EXPECT_EQ(h0.slot_array(), h1.slot_array());  // one vnode as no vnode
+  EXPECT_NE(h1.slot_array(), h2.slot_array());
+  EXPECT_EQ(h2.node_size(), 20);
+  EXPECT_EQ(h2.vnode_size(), 160);
+  for (size_t i = 0; i < h2.node_size(); ++i) {
+    const auto& n     = h2.node_manager()[i];
+    double      exact = 5003.0 * n->weight() / 390;  // 7 * 10 + 7 * 20 + 6 * 30
+    EXPECT_NEAR(n->slot_cnt(), exact, exact * 0.1);
+    // exact quota of a node is kept with vnodes
+    EXPECT_LT(std::abs(h3.node_manager()[i]->slot_cnt() - exact), 1.0);
+  }
+
+  // parallel build is the same
+  maglev::thread_pool pool(3);
+  auto                slots = h2.slot_array();
+  h2.build(pool);
+  EXPECT_EQ(h2.slot_array(), slots);
+  slots = h3.slot_array();
+  h3.build(pool);
+  EXPECT_EQ(h3.slot_array(), slots);
+
+  // vnodes take turns by vid first, so in a partial last round each node
+  // gets at most one slot more than others
+  using unweighted_hasher_t = maglev::maglev_hasher<
+      maglev::slot_counted_node_wrapper<maglev::node_base<int>>,
+      maglev::slot_array<int, 3359>>;
+  unweighted_hasher_t u, u2;
+  u.node_manager().set_vnode_cnt(16);
+  u2.node_manager().set_vnode_cnt(32);
+  for (int i = 0; i < 20; ++i) {
+    u.node_manager().new_back(i);
+    u2.node_manager().new_back(i);
+  }
+  EXPECT_TRUE(u.build());
+  auto cnt_cmp = [](const unweighted_hasher_t::node_ptr_t& l,
+                    const unweighted_hasher_t::node_ptr_t& r) {
+    return l->slot_cnt() < r->slot_cnt();
+  };
+  auto mm = std::minmax_element(
+      u.node_manager().begin(), u.node_manager().end(), cnt_cmp);
+  EXPECT_LE((*mm.second)->slot_cnt() - (*mm.first)->slot_cnt(), 1);
+  // fewer than min_slots_per_node() slots per vnode
+  EXPECT_FALSE(u2.is_buildable());
+  EXPECT_FALSE(u2.build());
+
+  // picks, stats and heartbeat are of physical nodes
+  maglev::maglev_balancer<> b;
+  b.node_manager().set_vnode_cnt(4);
+  for (int i = 0; i < 10; ++i) b.node_manager().new_back(std::to_string(i));
+  b.build();
+  EXPECT_EQ(b.node_manager().size(), 10);
+  for (int i = 0; i < 1000; ++i) {
+    auto ret = b.pick(maglev::def_hash_t<int>{}(i));
+    EXPECT_EQ(ret.node, b.node_manager()[ret.node_idx]);
+    ret.node->incr_load();
+    b.global_load().incr_load();
+  }
+  b.heartbeat();
+  size_t load_sum = 0;
+  for (const auto& n : b.node_manager()) load_sum += n->load().last();
+  EXPECT_EQ(load_sum, b.global_load().load().last());
+}
+
+TEST(hasher, maglev_hasher_exact_quota) {
+  using hasher_t = maglev::maglev_hasher<
+      maglev::weighted_node_wrapper<
+          maglev::slot_counted_node_wrapper<maglev::node_base<int>>>,
+      maglev::slot_array<int, 5003>>;
+  const unsigned int weights[] = {1, 1000, 3, 0, 250, 7, 7, 500};
+  const size_t       n         = sizeof(weights) / sizeof(weights[0]);
+  const size_t       w_sum = std::accumulate(weights, weights + n, size_t(0));
+
+  hasher_t h1, h2;
+  h1.set_exact_quota(true);
+  h2.set_exact_quota(true);
+  for (size_t i = 0; i < n; ++i) {
+    h1.node_manager().new_back(i)->set_weight(weights[i]);
+    h2.node_manager().new_back(i)->set_weight(weights[i]);
+  }
+  h1.build();
+  maglev::thread_pool pool(3);
+  h2.build(pool);
+  EXPECT_EQ(h1.slot_array(), h2.slot_array());
+
+  int cnt_sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const auto& node = h1.node_manager()[i];
+    maglev_watch(*node);
+    // largest remainder differs from round(M * w / W) by less than 1
+    double exact = 1.0 * h1.slot_size() * weights[i] / w_sum;
+    EXPECT_LT(std::abs(node->slot_cnt() - exact), 1.0);
+    EXPECT_EQ(node->slot_cnt(), h2.node_manager()[i]->slot_cnt());
+    cnt_sum += node->slot_cnt();
+  }
+  EXPECT_EQ(cnt_sum, h1.slot_size());
+  EXPECT_EQ(h1.node_manager()[3]->slot_cnt(), 0);
+
+  // unweighted nodes differ by at most one slot
+  maglev::maglev_hasher<
+      maglev::slot_counted_node_wrapper<maglev::node_base<int>>,
+      maglev::slot_array<int, 5003>>
+      h3;
+  h3.set_exact_quota(true);
+  for (int i = 0; i < 7; ++i) h3.node_manager().new_back(i);
+  h3.build();
+  for (const auto& node : h3.node_manager()) {
+    EXPECT_GE(node->slot_cnt(), 5003 / 7);
+    EXPECT_LE(node->slot_cnt(), 5003 / 7 + 1);
+  }
+}
+
+TEST(hasher, maglev_hasher_exact_quota_rebuild) {
+  using hasher_t = maglev::maglev_hasher<
+      maglev::weighted_node_wrapper<maglev::node_base<int>>,
+      maglev::slot_vector<>>;
+  hasher_t h;
+  h.set_exact_quota(true);
+  h.slot_array().resize(65537);
+  for (int i = 0; i < 20; ++i) {
+    h.node_manager().new_back(i)->set_weight(10 + i % 4 * 30);
+  }
+  h.build();
+
+  hasher_t::membership_delta_t delta;
+  delta.remove.push_back(7);
+  auto     r = h.diff_rebuild(delta);
+  hasher_t h2;
+  auto     r2 = h2.diff_rebuild_from(h, hasher_t::membership_delta_t{});
+  EXPECT_TRUE(r.rebuilt);
+  EXPECT_FALSE(r2.rebuilt);
+  EXPECT_TRUE(h2.exact_quota());
+  EXPECT_EQ(h.slot_array(), h2.slot_array());
+  maglev_watch(r.moved_slot_cnt);
+  // slots of the removed node must move, others should mostly stay
+  EXPECT_LT(r.moved_slot_cnt, h.slot_size() / 5);
+}
+
+TEST(hasher, slot_size_for) {
+  static_assert(maglev::slot_size_for(100) == 10007, "");
+  maglev::slot_array<int, maglev::slot_size_for(50)> a;
+  EXPECT_EQ(a.size(), 5003);
+  EXPECT_EQ(maglev::slot_size_for(50000), 5000011);
+  EXPECT_EQ(maglev::slot_size_for(1000, 0.1), 10007);
+  EXPECT_EQ(maglev::slot_size_for(0), 2);
+
+  for (double imbalance : {0.1, 0.01}) {
+    maglev::maglev_hasher<
+        maglev::slot_counted_node_wrapper<maglev::node_base<int>>,
+        maglev::slot_vector<>>
+        h;
+    for (int i = 0; i < 97; ++i) h.node_manager().new_back(i);
+    h.slot_array().resize(maglev::slot_size_for(h.node_size(), imbalance));
+    h.build();
+    double avg = double(h.slot_size()) / h.node_size();
+    for (const auto& n : h.node_manager()) {
+      EXPECT_LE(n->slot_cnt(), avg * (1 + imbalance));
+    }
+  }
+
+  // too few slots per node, or no node, is rejected in release builds too
+  maglev::maglev_hasher<maglev::node_base<int>, maglev::slot_vector<>> h;
+  h.slot_array().resize(1009);
+  EXPECT_FALSE(h.is_buildable());
+  EXPECT_FALSE(h.build());
+  for (int i = 0; i < 101; ++i) h.node_manager().new_back(i);
+  EXPECT_FALSE(h.build());
+  EXPECT_FALSE(h.build_parallel(2));
+  h.node_manager().pop_back();
+  EXPECT_TRUE(h.build());
+
+  decltype(h)::membership_delta_t delta;
+  delta.add.push_back(h.node_manager().new_node(100));
+  auto r = h.diff_rebuild(delta);
+  EXPECT_TRUE(r.failed);
+  EXPECT_FALSE(r.rebuilt);
+  EXPECT_EQ(h.node_size(), 100);
+}
+
+TEST(hasher, narrow_slot_array) {
+  static_assert(std::is_same<maglev::slot_int_for_t<256>, uint8_t>::value, "");
+  static_assert(std::is_same<maglev::slot_int_for_t<257>, uint16_t>::value,
+                "");
+  static_assert(
+      std::is_same<maglev::slot_int_for_t<65536>, uint16_t>::value, "");
+  static_assert(
+      std::is_same<maglev::slot_int_for_t<65537>, uint32_t>::value, "");
+
+  maglev::maglev_hasher<maglev::node_base<int>, maglev::slot_array<int, 5003>>
+      h1;
+  maglev::maglev_hasher<maglev::node_base<int>,
+                        maglev::narrow_slot_array<256, 5003>>
+      h2;
+  maglev::maglev_hasher<maglev::node_base<int>, maglev::packed_slot_vector<>>
+      h3;
+  h3.slot_array().resize(5003);
+  for (int i = 0; i < 256; ++i) {
+    h1.node_manager().new_back(i);
+    h2.node_manager().new_back(i);
+    h3.node_manager().new_back(i);
+  }
+  h1.build();
+  h2.build();
+  h3.build();
+  EXPECT_EQ(sizeof(h2.slot_array()), 5003);
+  EXPECT_EQ(h3.slot_array().bits(), 8);
+  for (size_t i = 0; i < 5003; ++i) {
+    EXPECT_EQ(h1.slot_array()[i], h2.slot_array()[i]);
+    EXPECT_EQ(h1.slot_array()[i], h3.slot_array()[i]);
+  }
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_EQ(h1.pick_with_auto_hash(i).node->id(),
+              h2.pick_with_auto_hash(i).node->id());
+    EXPECT_EQ(h1.pick_with_auto_hash(i).node->id(),
+              h3.pick_with_auto_hash(i).node->id());
+  }
+}
+
+TEST(hasher, packed_slot_vector) {
+  maglev::packed_slot_vector<> v(13, 5);
+  EXPECT_EQ(v.size(), 13);
+  EXPECT_EQ(v.bits(), 5);
+  for (size_t i = 0; i < v.size(); ++i) v.set(i, (i * 7 + 3) % 32);
+  for (size_t i = 0; i < v.size(); ++i) EXPECT_EQ(v[i], (i * 7 + 3) % 32);
+  v.set(4, 0);
+  v.set(5, 31);
+  EXPECT_EQ(v[3], 24);
+  EXPECT_EQ(v[4], 0);
+  EXPECT_EQ(v[5], 31);
+  EXPECT_EQ(v[6], 13);
+
+  v.set_bits_for(1000);
+  EXPECT_EQ(v.bits(), 10);
+  v.set_bits_for(1023);
+  EXPECT_EQ(v.bits(), 10);
+  v.set_bits_for(1024);
+  EXPECT_EQ(v.bits(), 11);
+  v.set_bits_for(0);
+  EXPECT_EQ(v.bits(), 1);
+}
+
+TEST(hasher, rehash_with_slot_mod) {
+  maglev::default_balance_strategy b;
+  maglev::fast_mod                 m(5003);
+  maglev::const_mod<5003>          cm;
+  for (size_t key = 0, x = 1; key < 1000; ++key) {
+    x = maglev::def_hash_t<size_t>{}(x);
+    for (size_t t = 0; t < 10; ++t) {
+      EXPECT_EQ(b.rehash(x, t, m), b.rehash(x, t, 5003));
+      EXPECT_EQ(b.rehash(x, t, cm), b.rehash(x, t, 5003));
+    }
+  }
+}
+
+TEST(hasher, pick_batch) {
+  maglev::maglev_balancer<> b;
+  for (int i = 0; i < 10; ++i) { b.node_manager().new_back(std::to_string(i)); }
+  b.build();
+
+  std::vector<size_t> hashes;
+  for (int i = 0; i < 1000; ++i) {
+    hashes.push_back(maglev::def_hash_t<int>{}(i));
+  }
+  std::vector<maglev::maglev_balancer<>::maglev_hasher_t::pick_ret_t> r1(
+      hashes.size());
+  b.maglev_hasher().pick_batch(hashes.data(), hashes.size(), r1.data());
+  std::vector<maglev::maglev_balancer<>::pick_ret_t> r2(hashes.size());
+  b.pick_batch(hashes.data(), hashes.size(), r2.data());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    auto r = b.maglev_hasher().pick(hashes[i]);
+    EXPECT_EQ(r1[i].node, r.node);
+    EXPECT_EQ(r1[i].node_idx, r.node_idx);
+    EXPECT_EQ(r2[i].node, r.node);
+    EXPECT_EQ(r2[i].node_idx, r.node_idx);
+  }
+
+  // same as pick() of the balancer with retries
+  for (bool node_distinct : {false, true}) {
+    b.balance_strategy().node_distinct_retry = node_distinct;
+    for (int i = 0; i < 3000; ++i) {
+      b.node_manager()[i % 3]->incr_load();
+      b.global_load().incr_load();
+    }
+    b.heartbeat();
+    b.pick_batch(hashes.data(), hashes.size(), r2.data());
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      auto r = b.pick(hashes[i]);
+      EXPECT_EQ(r2[i].node, r.node);
+      EXPECT_EQ(r2[i].retry_cnt, r.retry_cnt);
+      EXPECT_EQ(r2[i].consistent_node, r.consistent_node);
+    }
+  }
+}
+
+TEST(hasher, maglev_balancer_precomputed_verdict) {
+  // Same picks as live checks, since load is still checked live.
+  maglev::maglev_balancer<> b1, b2;
+  b2.balance_strategy().precomputed_verdict = true;
+  for (int i = 0; i < 10; ++i) {
+    b1.node_manager().new_back(std::to_string(i));
+    b2.node_manager().new_back(std::to_string(i));
+  }
+  b1.build();
+  b2.build();
+  int inconsistent_cnt = 0;
+  for (int i = 0; i < 12345; ++i) {
+    // skewed keys, so that some nodes are balanced
+    int  key = i % 3 == 0 ? 7 : i;
+    auto r1  = b1.pick_with_auto_hash(key);
+    auto r2  = b2.pick_with_auto_hash(key);
+    EXPECT_EQ(r1.node_idx, r2.node_idx);
+    EXPECT_EQ(r1.retry_cnt, r2.retry_cnt);
+    inconsistent_cnt += !r2.is_consistent;
+    for (auto* b : {&b1, &b2}) {
+      b->node_manager()[r1.node_idx]->incr_load();
+      b->global_load().incr_load();
+      if (i > 0 && i % 100 == 0) { b->heartbeat(); }
+    }
+  }
+  EXPECT_GT(inconsistent_cnt, 0);
+
+  // Verdicts of a replaced hasher are not taken for a new one, which gets a
+  // new generation, even if it is at the same address.
+  auto  gen = b2.maglev_hasher().generation();
+  auto* h   = new maglev::maglev_balancer<>::maglev_hasher_t;
+  for (int i = 0; i < 5; ++i) h->node_manager().new_back(std::to_string(i));
+  h->build();
+  b2.set_maglev_hasher(h);
+  EXPECT_GT(b2.maglev_hasher().generation(), gen);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_FALSE(b2.pick_with_auto_hash(i).failed);
+  }
+
+  // A node with fatal errors is banned by verdicts.
+  maglev::maglev_balancer<maglev::maglev_hasher<
+      maglev::load_stats_wrapper<maglev::node_base<std::string>,
+                                 maglev::server_load_stats_wrapper<>>>>
+      b;
+  b.balance_strategy().precomputed_verdict = true;
+  for (int i = 0; i < 10; ++i) { b.node_manager().new_back(std::to_string(i)); }
+  b.build();
+  int picked_cnt = 0;
+  for (int i = 0; i < 123456; ++i) {
+    auto ret   = b.pick_with_auto_hash(i);
+    bool fatal = ret.node->id() == "3";
+    if (i > 100000) picked_cnt += fatal;
+    ret.node->incr_load();
+    b.global_load().incr_load();
+    ret.node->incr_server_load(1, fatal, fatal, 100);
+    b.global_load().incr_server_load(1, fatal, fatal, 100);
+    if (i > 0 && i % 300 == 0) { b.heartbeat(); }
+  }
+  EXPECT_GT(b.banned_cnt(), 0);
+  // banned in most periods, see should_ban_server()
+  EXPECT_LT(picked_cnt, 23456 / 10 * 2 / 3);
+
+  // Verdicts are carried over to a new hasher by node id, so the node is
+  // still banned before the next heartbeat.
+  auto is_banned = [&b]() {
+    for (int i = 0; i < 10000; ++i) {
+      if (b.pick_with_auto_hash(i).node->id() == "3") return false;
+    }
+    return true;
+  };
+  for (int p = 0; p < 10 && !is_banned(); ++p) {
+    for (int i = 0; i < 300; ++i) {
+      auto ret   = b.pick_with_auto_hash(i);
+      bool fatal = ret.node->id() == "3";
+      ret.node->incr_load();
+      b.global_load().incr_load();
+      ret.node->incr_server_load(1, fatal, fatal, 100);
+      b.global_load().incr_server_load(1, fatal, fatal, 100);
+    }
+    b.heartbeat();
+  }
+  ASSERT_TRUE(is_banned());
+  auto* h2 = new decltype(b)::maglev_hasher_t;
+  for (int i = 10; i >= 0; --i) {
+    h2->node_manager().new_back(std::to_string(i));
+  }
+  h2->build();
+  b.set_maglev_hasher(h2);
+  EXPECT_TRUE(is_banned());
+
+  // The hasher can be taken out, and is deleted after readers leave.
+  b.set_maglev_hasher(nullptr);
+}
+
+TEST(hasher, bounded_load_balance_strategy) {
+  using balancer_t = maglev::maglev_balancer<
+      maglev::maglev_hasher<
+          maglev::load_stats_wrapper<maglev::node_base<std::string>,
+                                     maglev::inflight_wrapper<>>>,
+      maglev::bounded_load_balance_strategy>;
+  for (bool precomputed_verdict : {false, true}) {
+    balancer_t b;
+    b.balance_strategy().precomputed_verdict = precomputed_verdict;
+    for (int i = 0; i < 10; ++i) {
+      b.node_manager().new_back(std::to_string(i));
+    }
+    b.build();
+
+    // 200 queries in flight, a third of them with the same key
+    std::vector<balancer_t::node_ptr_t> inflight;
+    int                                 inconsistent_cnt = 0;
+    for (int i = 0; i < 12345; ++i) {
+      if (inflight.size() == 200) {
+        auto n = inflight[i % 200];
+        n->decr_inflight();
+        b.global_load().decr_inflight();
+        inflight[i % 200] = nullptr;
+      }
+      auto ret = b.pick_with_auto_hash(i % 3 == 0 ? 7 : i);
+      EXPECT_FALSE(ret.failed);
+      inconsistent_cnt += !ret.is_consistent;
+      ret.node->incr_inflight();
+      b.global_load().incr_inflight();
+      if (inflight.size() < 200) {
+        inflight.push_back(ret.node);
+      } else {
+        inflight[i % 200] = ret.node;
+      }
+      size_t cap = b.balance_strategy().bounded_load(
+          b.global_load().inflight(), b.node_size());
+      for (const auto& n : b.node_manager()) {
+        EXPECT_LE(size_t(n->inflight()), cap);
+      }
+      if (i > 0 && i % 100 == 0) { b.heartbeat(); }
+    }
+    EXPECT_EQ(b.global_load().inflight(), 200);
+    EXPECT_GT(inconsistent_cnt, 12345 / 3 / 2);
+  }
+}
+
+TEST(hasher, node_distinct_retry) {
+  using hasher_t =
+      maglev::maglev_hasher<maglev::node_base<int>, maglev::slot_vector<>>;
+  maglev::default_balance_strategy s;
+  for (size_t n = 1; n < 70; n += 3) {
+    hasher_t h;
+    h.slot_array().resize(1009);
+    for (size_t i = 0; i < n; ++i) h.node_manager().new_back(int(i) * 7);
+    h.build();
+    for (size_t key = 0; key < 200; ++key) {
+      size_t hashed = maglev::def_hash_t<size_t>{}(key);
+      size_t first  = h.slot_array()[s.rehash(hashed, 0, h.slot_mod())];
+      auto   seq    = s.node_sequence(hashed, first, h);
+      std::vector<bool> seen(n, false);
+      seen[first] = true;
+      for (size_t i = 1; i < n; ++i) {
+        size_t idx = seq.next();
+        ASSERT_LT(idx, n);
+        EXPECT_FALSE(seen[idx]);
+        seen[idx] = true;
+      }
+    }
+  }
+
+  // Orders are of slot owners, so a node removed changes few orders, even if
+  // indexes of other nodes are shifted.
+  hasher_t h1, h2;
+  h1.slot_array().resize(5003);
+  for (int i = 0; i < 40; ++i) h1.node_manager().new_back(i);
+  h1.build();
+  hasher_t::membership_delta_t delta;
+  delta.remove.push_back(10);
+  EXPECT_TRUE(h2.diff_rebuild_from(h1, delta).rebuilt);
+  auto retry_ids_of = [&s](const hasher_t& h, size_t key) {
+    size_t           first = h.slot_array()[s.rehash(key, 0, h.slot_mod())];
+    auto             seq   = s.node_sequence(key, first, h);
+    std::vector<int> ids;
+    for (size_t i = 1; i < h.node_size(); ++i) {
+      int id = h.node_manager()[seq.next()]->id();
+      if (id != 10) ids.push_back(id);
+    }
+    ids.resize(3);
+    return ids;
+  };
+  int same_cnt = 0;
+  for (size_t key = 0; key < 1000; ++key) {
+    size_t hashed = maglev::def_hash_t<size_t>{}(key);
+    same_cnt += retry_ids_of(h1, hashed) == retry_ids_of(h2, hashed);
+  }
+  EXPECT_GT(same_cnt, 800);
+
+  maglev::maglev_balancer<> b;
+  b.balance_strategy().node_distinct_retry = true;
+  for (int i = 0; i < 10; ++i) { b.node_manager().new_back(std::to_string(i)); }
+  b.build();
+  int inconsistent_cnt = 0;
+  for (int i = 0; i < 12345; ++i) {
+    auto ret = b.pick_with_auto_hash(i % 3 == 0 ? 7 : i);
+    EXPECT_LT(ret.retry_cnt, b.node_size());
+    inconsistent_cnt += !ret.is_consistent;
+    ret.node->incr_load();
+    b.global_load().incr_load();
+    if (i > 0 && i % 100 == 0) { b.heartbeat(); }
+  }
+  EXPECT_GT(inconsistent_cnt, 0);
+}
+
+TEST(hasher, pick_raw) {
+  maglev::maglev_hasher<> h;
+  for (int i = 0; i < 10; ++i) { h.node_manager().new_back(std::to_string(i)); }
+  h.build();
+  for (size_t k = 0; k < 1000; ++k) {
+    auto ret = h.pick(k);
+    auto raw = h.pick_raw(k);
+    EXPECT_EQ(raw.node_idx, ret.node_idx);
+    EXPECT_EQ(raw.node, ret.node.get());
+  }
+
+  for (bool node_distinct : {false, true}) {
+    maglev::maglev_balancer<> b;
+    b.balance_strategy().node_distinct_retry = node_distinct;
+    for (int i = 0; i < 10; ++i) {
+      b.node_manager().new_back(std::to_string(i));
+    }
+    b.build();
+    long use_cnt          = b.node_manager()[0].use_count();
+    int  inconsistent_cnt = 0;
+    for (int i = 0; i < 12345; ++i) {
+      size_t              k = maglev::def_hash_t<int>{}(i % 3 ? i : 7);
+      maglev::epoch_guard guard;
+      auto                raw = b.pick_raw(k);
+      auto                ret = b.pick(k);
+      EXPECT_EQ(raw.node, ret.node.get());
+      EXPECT_EQ(raw.node_idx, ret.node_idx);
+      EXPECT_EQ(raw.consistent_node, ret.consistent_node.get());
+      EXPECT_EQ(raw.consistent_node_idx, ret.consistent_node_idx);
+      EXPECT_EQ(raw.is_consistent, ret.is_consistent);
+      EXPECT_EQ(raw.retry_cnt, ret.retry_cnt);
+      EXPECT_EQ(raw.failed, ret.failed);
+      inconsistent_cnt += !raw.is_consistent;
+      raw.node->incr_load();
+      b.global_load().incr_load();
+      if (i > 0 && i % 100 == 0) { b.heartbeat(); }
+    }
+    EXPECT_GT(inconsistent_cnt, 0);
+    EXPECT_EQ(b.node_manager()[0].use_count(), use_cnt);
+  }
+}
+
+TEST(hasher, top_k_rank) {
+  using balancer_t = maglev::maglev_balancer<maglev::maglev_hasher<
+      maglev::load_stats_wrapper<maglev::node_base<int>,
+                                 maglev::server_load_stats_wrapper<>>>>;
+  balancer_t b;
+  for (int i = 0; i < 200; ++i) { b.node_manager().new_back(i); }
+  b.build();
+  for (int i = 0; i < 100000; ++i) {
+    auto ret   = b.pick_with_auto_hash(i);
+    int  id    = ret.node->id();
+    bool fatal = rand() % 1000 < id % 7;
+    bool error = fatal || rand() % 100 < id % 11;
+    int  lat   = 100 + rand() % (id + 1);
+    ret.node->incr_load();
+    b.global_load().incr_load();
+    ret.node->incr_server_load(1, error, fatal, lat);
+    b.global_load().incr_server_load(1, error, fatal, lat);
+    if (i > 0 && i % 10000 == 0) { b.heartbeat(); }
+  }
+
+  auto& s              = b.balance_strategy();
+  s.top_k_rank         = true;
+  s.max_rank_to_report = 5;
+  s.heartbeat(b.global_load(), b.node_manager());
+
+  // node order is unchanged
+  for (int i = 0; i < 200; ++i) { EXPECT_EQ(b.node_manager()[i]->id(), i); }
+
+  // Ranks 1..k are in order of metric, others are node_size and not larger.
+  auto check = [&](size_t k, auto metric, auto rank) {
+    std::vector<double> top(k + 1, 0);
+    std::vector<bool>   seen(k + 1, false);
+    for (const auto& n : b.node_manager()) {
+      size_t r = rank(n);
+      if (r == 200) continue;
+      ASSERT_GE(r, 1);
+      ASSERT_LE(r, k);
+      EXPECT_FALSE(seen[r]);
+      seen[r] = true;
+      top[r]  = metric(n);
+    }
+    for (size_t r = 1; r <= k; ++r) {
+      EXPECT_TRUE(seen[r]);
+      if (r > 1) { EXPECT_GE(top[r - 1], top[r]); }
+    }
+    for (const auto& n : b.node_manager()) {
+      if (rank(n) == 200) { EXPECT_LE(metric(n), top[k]); }
+    }
+  };
+  using node_ptr_t = balancer_t::node_ptr_t;
+  check(
+      5,
+      [](const node_ptr_t& n) { return double(n->load().sum()); },
+      [](const node_ptr_t& n) { return n->load_rank(); });
+  check(
+      5,
+      [](const node_ptr_t& n) { return double(n->query().sum()); },
+      [](const node_ptr_t& n) { return n->query_rank(); });
+  check(
+      6,
+      [](const node_ptr_t& n) { return n->error_rate_of_window(); },
+      [](const node_ptr_t& n) { return n->error_rank(); });
+  check(
+      5,
+      [](const node_ptr_t& n) { return n->fatal_rate_of_window(); },
+      [](const node_ptr_t& n) { return n->fatal_rank(); });
+  check(
+      6,
+      [](const node_ptr_t& n) { return n->avg_latency_of_window(); },
+      [](const node_ptr_t& n) { return n->latency_rank(); });
+}
+
+TEST(hasher, snapshot) {
+  using node_t        = maglev::weighted_node_wrapper<maglev::node_base<int>>;
+  using hasher_t      = maglev::maglev_hasher<node_t, maglev::slot_vector<>>;
+  using view_hasher_t = maglev::maglev_hasher<node_t, maglev::slot_view<>>;
+  const std::string path = "maglev_hasher_snapshot_test.bin";
+
+  hasher_t h;
+  h.set_exact_quota(true);
+  h.slot_array().resize(5003);
+  for (int i = 0; i < 20; ++i) {
+    h.node_manager().new_back(i)->set_weight(10 + i % 3);
+  }
+  h.build();
+  EXPECT_TRUE(maglev::write_snapshot(h, path));
+
+  maglev::snapshot s;
+  EXPECT_TRUE(s.open(path));
+  EXPECT_EQ(s.slot_size(), 5003);
+  EXPECT_EQ(s.node_size(), 20);
+  EXPECT_TRUE(s.is_weighted());
+  EXPECT_TRUE(s.exact_quota());
+
+  view_hasher_t v;
+  for (int i = 19; i >= 0; --i) {
+    v.node_manager().new_back(i)->set_weight(10 + i % 3);
+  }
+  EXPECT_TRUE(maglev::load_snapshot(v, s));
+  EXPECT_EQ(v.slot_array().data(), s.slots<int>().data());
+  for (size_t i = 0; i < 10000; ++i) {
+    EXPECT_EQ(v.pick(i).node->id(), h.pick(i).node->id());
+  }
+
+  std::vector<std::pair<int, unsigned int>> nodes;
+  s.for_each_node([&](unsigned int w, const char* id, size_t sz) {
+    int x = 0;
+    EXPECT_TRUE(maglev::snapshot_id_codec<int>::decode(id, sz, x));
+    nodes.emplace_back(x, w);
+  });
+  EXPECT_EQ(nodes.size(), 20);
+  EXPECT_EQ(nodes[7].first, 7);
+  EXPECT_EQ(nodes[7].second, 11);
+
+  // node list differs from snapshot
+  view_hasher_t v2;
+  for (int i = 0; i < 20; ++i) v2.node_manager().new_back(i)->set_weight(10);
+  EXPECT_FALSE(maglev::load_snapshot(v2, s));
+  s.close();
+
+  // corrupted
+  {
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(200);
+    f.put('\x7f');
+  }
+  EXPECT_FALSE(s.open(path));
+  EXPECT_TRUE(s.open(path, false));
+  s.close();
+
+  // Out of bounds node records or slot entries are rejected without checksum.
+  auto corrupt = [&](std::streamoff off, std::uint32_t x) {
+    EXPECT_TRUE(maglev::write_snapshot(h, path));
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(off);
+    f.write(reinterpret_cast<const char*>(&x), sizeof(x));
+  };
+  const std::streamoff node_table = sizeof(maglev::snapshot_header);
+  const std::streamoff slot_table = 448;  // node table of 20 * 16 bytes
+  corrupt(node_table + 4, 1000);          // id bytes of node 0
+  EXPECT_FALSE(s.open(path, false));
+  corrupt(node_table + 19 * 16 + 4, 9);  // id of the last node padded over
+  EXPECT_FALSE(s.open(path, false));
+  corrupt(slot_table + 4 * 10, 20);  // node index of slot 10
+  EXPECT_FALSE(s.open(path, false));
+  corrupt(slot_table + 4 * 10, -1);
+  EXPECT_FALSE(s.open(path, false));
+  corrupt(slot_table + 4 * 10, 19);
+  EXPECT_TRUE(s.open(path, false));
+  std::remove(path.c_str());
+}
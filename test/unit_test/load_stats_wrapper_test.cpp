@@ -27,5 +27,10 @@ TEST(stats, node_stats_wrapper) {
   EXPECT_EQ(a.load().last(), 1);
   EXPECT_EQ(a.load().sum(), 1);
 
+  const node_t& c = a;
+  EXPECT_EQ(&c.load_stats(), &a.load_stats());
+  EXPECT_EQ(&c.node_meta(), &a.node_meta());
+  EXPECT_EQ(c.node_meta().id(), 1);
+
   maglev_watch(a, a.to_str());
 }
@@ -51,6 +51,45 @@ TEST(node_manager, node_manager_base) {
   maglev_watch_with_std_cout(nm);
 }
 
+TEST(node_manager, id_index) {
+  maglev::node_manager_base<maglev::node_base<>> nm;
+  for (int i = 0; i < 1000; ++i) nm.new_back("node" + std::to_string(i));
+  EXPECT_FALSE(nm.has_id_index());
+  EXPECT_EQ(nm.find_by_node_id("node3"), nullptr);  // not sorted yet
+
+  nm.ready_go();
+  EXPECT_TRUE(nm.has_id_index());
+  for (size_t i = 0; i < nm.size(); ++i) {
+    EXPECT_EQ(nm.find_idx_by_node_id(nm[i]->id()), i);
+  }
+  EXPECT_EQ(nm.find_by_node_id("node3")->id(), "node3");
+  EXPECT_EQ(nm.find_idx_by_node_id("node1000"), nm.npos);
+  EXPECT_EQ(nm.find_by_node_id(""), nullptr);
+
+  // falls back to binary search until next ready_go()
+  nm.pop_back();
+  EXPECT_FALSE(nm.has_id_index());
+  EXPECT_EQ(nm.find_by_node_id("node3")->id(), "node3");
+  nm.ready_go();
+  EXPECT_TRUE(nm.has_id_index());
+  EXPECT_EQ(nm.find_by_node_id("node3")->id(), "node3");
+
+  auto copy = nm;
+  EXPECT_TRUE(copy.has_id_index());
+  EXPECT_EQ(copy.find_by_node_id("node3"), nm.find_by_node_id("node3"));
+
+  // a node replaced after ready_go() is found, though the size is the same
+  maglev::node_manager_base<maglev::node_base<int>> nm2;
+  for (int i = 0; i < 10; ++i) nm2.new_back(i);
+  nm2.ready_go();
+  nm2.pop_back();
+  nm2.new_back(20);
+  EXPECT_TRUE(nm2.has_id_index());
+  EXPECT_EQ(nm2.find_idx_by_node_id(20), 9);
+  EXPECT_EQ(nm2.find_by_node_id(9), nullptr);
+  EXPECT_EQ(nm2.find_by_node_id(5)->id(), 5);
+}
+
 TEST(node_manager, weighted_node_manager_wrapper) {
   maglev::weighted_node_manager_wrapper<maglev::node_manager_base<
       maglev::weighted_node_wrapper<maglev::node_base<int>>>>
@@ -101,3 +140,99 @@ TEST(node_manager, weighted_node_manager_same_weights) {
   nm.find_by_node_id(4)->incr_load();
   maglev_watch_with_std_cout(nm);
 }
+
+TEST(node_manager, apply_membership) {
+  using node_type = maglev::load_stats_wrapper<
+      maglev::weighted_node_wrapper<maglev::node_base<int>>,
+      maglev::load_stats<>>;
+  maglev::weighted_node_manager_wrapper<maglev::node_manager_base<node_type>>
+      nm;
+  for (int i = 1; i <= 4; ++i) nm.new_back(i)->set_weight(10);
+  nm.ready_go();
+  nm.find_by_node_id(2)->incr_load();
+  auto load = nm.find_by_node_id(2)->load().now();
+  EXPECT_GT(load, 0);
+
+  std::vector<std::shared_ptr<node_type>> list;
+  for (int i : {4, 3, 2, 1}) list.push_back(nm.new_node(i));
+  for (auto& n : list) n->set_weight(10);
+  EXPECT_TRUE(nm.diff_membership(list).empty());
+  EXPECT_FALSE(nm.apply_membership(list));
+
+  list[3] = nm.new_node(0);  // remove 1, add 0
+  list[3]->set_weight(10);
+  list[0]->set_weight(40);  // 4
+  list.push_back(nm.new_node(5));
+  list.back()->set_weight(10);
+  auto diff = nm.diff_membership(list);
+  EXPECT_EQ(diff.add.size(), 2);
+  EXPECT_EQ(diff.remove, std::vector<int>{1});
+  EXPECT_EQ(diff.reweight.size(), 1);
+
+  EXPECT_TRUE(nm.apply_membership(list));
+  EXPECT_EQ(nm.size(), 5);
+  EXPECT_TRUE(nm.is_sorted());
+  EXPECT_TRUE(nm.has_id_index());
+  EXPECT_EQ(nm.find_by_node_id(1), nullptr);
+  EXPECT_EQ(nm.find_by_node_id(0), list[3]);
+  EXPECT_NE(nm.find_by_node_id(4), list[0]);  // node kept
+  EXPECT_EQ(nm.find_by_node_id(4)->weight(), 40);
+  EXPECT_EQ(nm.find_by_node_id(2)->load().now(), load);  // stats kept
+  EXPECT_EQ(nm.weight_sum(), 80);
+  EXPECT_FALSE(nm.apply_membership(list));
+}
+
+TEST(node_manager, arena_node_manager) {
+  using node_type = maglev::load_stats_wrapper<maglev::node_base<int>,
+                                               maglev::load_stats<>>;
+  maglev::arena_node_manager<node_type> nm(4);
+  for (int i = 10; i > 0; --i) nm.new_back(i);
+  nm.push_back(nm.new_node(0));
+  EXPECT_EQ(nm.size(), 11);
+  EXPECT_EQ(nm.arena().chunk_cnt(), 3);
+  EXPECT_EQ(nm.arena().block_size() % 64, 0);
+
+  // nodes are at the same offset of cacheline aligned blocks, contiguous in
+  // a chunk, so no two nodes share a cacheline
+  auto addr = [&](size_t i) { return reinterpret_cast<size_t>(nm[i].get()); };
+  for (size_t i = 0; i < nm.size(); ++i) {
+    EXPECT_EQ(addr(i) % 64, addr(0) % 64);
+    EXPECT_LE(addr(i) % 64 + sizeof(node_type), nm.arena().block_size());
+  }
+  for (size_t i = 1; i < 4; ++i) {
+    EXPECT_EQ(addr(i) - addr(i - 1), nm.arena().block_size());
+  }
+
+  // nodes of a cacheline aligned type are cacheline aligned
+  using aligned_node_type =
+      maglev::load_stats_wrapper<maglev::node_base<int>,
+                                 maglev::sharded_load_stats<>>;
+  maglev::arena_node_manager<aligned_node_type> anm(4);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(reinterpret_cast<size_t>(anm.new_back(i).get()) % 64, 0);
+  }
+
+  nm.ready_go();
+  EXPECT_TRUE(nm.is_sorted());
+  EXPECT_EQ(nm.find_by_node_id(3)->id(), 3);
+  nm.find_by_node_id(3)->incr_load();
+  EXPECT_EQ(nm.find_by_node_id(3)->load().now(), 1);
+
+  // blocks of destroyed nodes are reused, nodes outlive the node manager
+  node_type* p = nm.back().get();
+  nm.pop_back();
+  auto n = nm.new_node(11);
+  EXPECT_EQ(n.get(), p);
+  { auto copy = nm; }
+  nm.clear();
+  EXPECT_EQ(n->id(), 11);
+
+  maglev::maglev_hasher<node_type,
+                        maglev::slot_array<int>,
+                        maglev::arena_node_manager<node_type>>
+      h;
+  for (int i = 0; i < 10; ++i) h.node_manager().new_back(i);
+  h.build();
+  EXPECT_EQ(h.node_size(), 10);
+  EXPECT_EQ(h.pick(12345).node, h.node_manager()[h.pick(12345).node_idx]);
+}
@@ -63,4 +63,17 @@ TEST(permutation, permutation_generator_with_rand) {
   EXPECT_EQ(s2, s3);
 
   EXPECT_NE(p1, p2);
-}
\ No newline at end of file
+}
+
+TEST(permutation, permutation_generator_64bit) {
+  const unsigned long long      n = maglev::next_prime(1ULL << 33);
+  maglev::permutation_generator g(n, maglev::def_hash_t<int>{}(23596985));
+  const auto                    offset = g.offset(), step = g.step();
+  EXPECT_LT(offset, n);
+  EXPECT_LT(step, n);
+  for (unsigned long long k = 0; k < 100000; ++k) {
+    auto t = g.gen_one_num();
+    ASSERT_LT(t, n);
+    ASSERT_EQ(t, (offset + maglev::mul_mod(k, step, n)) % n);
+  }
+}
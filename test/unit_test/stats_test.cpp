@@ -12,9 +12,17 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <atomic>
+#include <cstdint>
 #include <ctime>
+#include <memory>
+#include <thread>
+#include <vector>
 
+#include "maglev/stats/shm_sliding_window.h"
 #include "unit_test.h"
 
 TEST(stats, atomic_counter) {
@@ -55,6 +63,10 @@ TEST(stats, atomic_counter) {
   EXPECT_EQ(b.get(), 0);
   EXPECT_EQ(b, 0);
 
+  b = 7;
+  EXPECT_EQ(b.exchange(0), 7);
+  EXPECT_EQ(b, 0);
+
   // assignment
   maglev::atomic_counter<> x, y;
   EXPECT_EQ(x, y);
@@ -153,6 +165,74 @@ TEST(stats, atomic_counter) {
   }
 }
 
+struct sharded_stats_node : maglev::node_base<int> {
+  using maglev::node_base<int>::node_base;
+  maglev::sharded_load_stats<> stats;
+};
+
+TEST(stats, sharded_counter) {
+  maglev::sharded_counter<> a;
+  EXPECT_EQ(a, 0);
+  EXPECT_EQ(a.unit(), 1);
+  ++a;
+  a += 10;
+  --a;
+  a -= 2;
+  EXPECT_EQ(a.get(), 8);
+  EXPECT_EQ(a + 1, 9);
+  EXPECT_EQ(a - 1, 7);
+  a.set_unit(3);
+  ++a;
+  EXPECT_EQ(a, 11);
+
+  maglev::sharded_counter<> b(a);
+  EXPECT_EQ(b, 11);
+  EXPECT_EQ(b.unit(), 3);
+  b = 5;
+  EXPECT_EQ(b, 5);
+  a = b;
+  EXPECT_EQ(a, 5);
+  EXPECT_EQ(a.exchange(2), 5);
+  EXPECT_EQ(a, 2);
+  a.clear();
+  EXPECT_EQ(a, 0);
+
+  // increments of threads are spread over shards, and all are summed
+  maglev::sharded_counter<long long, 4> c;
+  std::vector<std::thread>              threads;
+  long long                             taken = 0;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&c]() {
+      for (int i = 0; i < 10000; ++i) ++c;
+    });
+  }
+  taken += c.exchange(0);
+  for (auto& t : threads) t.join();
+  EXPECT_EQ(taken + c.get(), 80000);
+
+  // as counter of now of a sliding window
+  maglev::sliding_window<int, 4, maglev::sharded_counter<int>> w;
+  w.incr();
+  w.incr(2);
+  EXPECT_EQ(w.now(), 3);
+  w.heartbeat();
+  EXPECT_EQ(w.now(), 0);
+  EXPECT_EQ(w.last(), 3);
+  EXPECT_EQ(w.sum(), 3);
+
+  // shards are cacheline aligned also on heap, and so are nodes of them
+  std::vector<std::unique_ptr<maglev::sharded_counter<>>> heap;
+  for (int i = 0; i < 100; ++i) {
+    heap.emplace_back(new maglev::sharded_counter<>);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(heap.back().get()) % 64, 0);
+  }
+  using node_manager_t = maglev::node_manager_base<sharded_stats_node>;
+  for (int i = 0; i < 100; ++i) {
+    auto n = node_manager_t::new_node(i);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&n->stats) % 64, 0);
+  }
+}
+
 TEST(stats, cycle_index) {
   EXPECT_EQ(maglev::cycle_index<64>{}, 0);
   EXPECT_EQ(maglev::cycle_index<64>(64), 0);
@@ -299,6 +379,16 @@ TEST(stats, load_stats) {
 
   maglev_watch(a, a.to_str());
 
+  maglev::sharded_load_stats<> sa, sg;
+  sa.incr_load(3);
+  sg.incr_load(3);
+  EXPECT_EQ(sa.load().now(), 3);
+  sa.heartbeat();
+  EXPECT_EQ(sa.load().last(), 3);
+  EXPECT_EQ(maglev::default_balance_strategy{}.load_limit(sg, 1),
+            maglev::default_balance_strategy{}.load_limit_of(sg, 1));
+  maglev_watch(sa, sa.to_str());
+
   maglev::load_stats<int, 33> b;
   b.set_load_unit(3);
   EXPECT_EQ(b.load_unit(), 3);
@@ -357,6 +447,34 @@ TEST(stats, load_stats) {
 
   maglev_watch(s, s.to_str());
 
+  // counts of now are in one record, and a copy has its own record
+  s.incr_server_load(10, 1, 0, 500);
+  s.query().incr();
+  EXPECT_EQ(s.record().query, 11);
+  EXPECT_EQ(s.record().error, 1);
+  EXPECT_EQ(s.record().latency, 500);
+  auto t = s;
+  t.incr_server_load(10, 1, 1, 500);
+  EXPECT_EQ(s.query().now(), 11);
+  EXPECT_EQ(t.query().now(), 21);
+  EXPECT_EQ(t.fatal().now(), 1);
+  EXPECT_EQ(t.query().last(), 100);
+  t = s;
+  EXPECT_EQ(t.query().now(), 11);
+  t.heartbeat();
+  EXPECT_EQ(t.query().last(), 11);
+  EXPECT_EQ(s.query().now(), 11);
+
+  // records are cacheline aligned also on heap
+  std::vector<std::unique_ptr<maglev::outcome_record<>>> records;
+  for (int i = 0; i < 1000; ++i) {
+    records.emplace_back(new maglev::outcome_record<>);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(records.back().get()) % 64, 0);
+  }
+  auto heap_s = std::allocate_shared<decltype(s)>(
+      maglev::aligned_allocator<decltype(s)>(), s);
+  EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&heap_s->record()) % 64, 0);
+
   maglev::server_load_stats_wrapper<maglev::fake_load_stats<int, 4>> x;
 
   x.incr_server_load(10, 2, 1, 100 * 1000);
@@ -400,4 +518,95 @@ TEST(stats, load_stats) {
   EXPECT_EQ(x.latency().sum(), 238 * 1000);
 
   maglev_watch(x, x.to_str());
-}
\ No newline at end of file
+}
+
+TEST(stats, shm_load_stats) {
+  const std::string name = "/maglev_unit_test_" + std::to_string(::getpid());
+  maglev::shm_region::unlink(name);
+  maglev::shm_region r, r2, bad;
+  ASSERT_TRUE(r.open(name, 1024, 64));
+  EXPECT_EQ(r.block_cnt(), 64);
+  EXPECT_FALSE(bad.open(name, 1024, 32));  // geometry differs
+
+  using stats_t = maglev::shm_load_stats<unsigned long long, 4>;
+  maglev::maglev_balancer<maglev::maglev_hasher<
+      maglev::load_stats_wrapper<maglev::node_base<int>, stats_t>>>
+      b;
+  for (int i = 0; i < 10; ++i) b.node_manager().new_back(i);
+  EXPECT_TRUE(maglev::bind_shm_load_stats(b, r));
+
+  // a worker process adds load to the same windows
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    maglev::shm_region child;
+    if (!child.open(name, 1024, 64)) ::_exit(1);
+    maglev::load_stats_wrapper<maglev::node_base<int>, stats_t> n(3);
+    if (!n.load().bind(child, n.id_hash())) ::_exit(2);
+    n.incr_load(100);
+    ::_exit(0);
+  }
+  ASSERT_GT(pid, 0);
+  int status = -1;
+  ::waitpid(pid, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  b.node_manager()[3]->incr_load(10);
+  EXPECT_EQ(b.node_manager()[3]->load().now(), 110);
+  b.global_load().incr_load(110);
+
+  // only the lease holder advances windows
+  ASSERT_TRUE(r2.open(name, 1024, 64));
+  r2.set_lease_token(r.lease_token() + 1);
+  b.heartbeat();
+  EXPECT_EQ(b.node_manager()[3]->load().now(), 110);
+  EXPECT_TRUE(r2.try_lease(std::chrono::seconds(10)));
+  EXPECT_FALSE(r.try_lease(std::chrono::seconds(10)));
+  EXPECT_FALSE(r.lease_held());
+  r2.release_lease();
+  EXPECT_TRUE(r.try_lease(std::chrono::seconds(10)));
+  EXPECT_TRUE(r.lease_held());
+  b.heartbeat();
+  EXPECT_EQ(b.node_manager()[3]->load().now(), 0);
+  EXPECT_EQ(b.node_manager()[3]->load().last(), 110);
+  EXPECT_EQ(b.node_manager()[3]->load().sum(), 110);
+  EXPECT_EQ(b.global_load().heartbeat_cnt(), 1);
+
+  // seen by another mapping
+  stats_t s;
+  EXPECT_TRUE(s.load().bind(r2, b.node_manager()[3]->id_hash()));
+  EXPECT_EQ(s.load().last(), 110);
+  EXPECT_EQ(s.heartbeat_cnt(), 1);
+  maglev_watch(s, s.to_str());
+
+  // a balancer in another namespace has its own windows
+  decltype(b) b2;
+  for (int i = 0; i < 10; ++i) b2.node_manager().new_back(i);
+  EXPECT_TRUE(maglev::bind_shm_load_stats(b2, r, 1));
+  EXPECT_EQ(b2.node_manager()[3]->load().last(), 0);
+  EXPECT_EQ(b2.global_load().heartbeat_cnt(), 0);
+
+  // blocks too small for a window
+  maglev::shm_region small;
+  ASSERT_TRUE(small.open(name + "_small", 64, 4));
+  EXPECT_FALSE(s.load().bind(small, 1));
+  EXPECT_EQ(s.load().last(), 110);  // still bound to r2
+  EXPECT_TRUE(maglev::shm_region::unlink(name + "_small"));
+
+  // Unbound windows are local, e.g. of nodes added after binding.
+  stats_t u;
+  EXPECT_FALSE(u.load().is_bound());
+  u.incr_load(7);
+  u.heartbeat();
+  EXPECT_EQ(u.load().last(), 7);
+  stats_t u2 = u;  // a local copy
+  u2.incr_load(1);
+  EXPECT_EQ(u.load().now(), 0);
+  EXPECT_EQ(u2.load().now(), 1);
+  EXPECT_EQ(u2.load().last(), 7);
+  stats_t s2 = s;  // bound to the same block
+  EXPECT_TRUE(s2.load().is_bound());
+  EXPECT_EQ(s2.load().last(), 110);
+  EXPECT_TRUE(u.load().bind(r, 12345));
+  EXPECT_EQ(u.load().last(), 0);
+
+  EXPECT_TRUE(maglev::shm_region::unlink(name));
+}
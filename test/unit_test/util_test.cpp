@@ -32,6 +32,22 @@ TEST(util, prime) {
   EXPECT_TRUE(maglev::is_prime(3));
   EXPECT_TRUE(maglev::is_prime(5003));
   EXPECT_TRUE(maglev::is_prime(65537));
+
+  // 64 bits
+  EXPECT_FALSE(maglev::is_prime(4759123141ULL));  // 48781 * 97561
+  EXPECT_FALSE(maglev::is_prime(4294967297ULL));  // 641 * 6700417
+  EXPECT_FALSE(maglev::is_prime(3825123056546413051ULL));
+  EXPECT_TRUE(maglev::is_prime(4294967311ULL));
+  EXPECT_TRUE(maglev::is_prime(2305843009213693951ULL));  // 2^61 - 1
+  EXPECT_TRUE(maglev::is_prime(18446744073709551557ULL));
+  EXPECT_EQ(maglev::mul_mod(~0ULL, ~0ULL, 1000000007ULL),
+            (~0ULL % 1000000007ULL) * (~0ULL % 1000000007ULL) % 1000000007ULL);
+
+  static_assert(maglev::next_prime(100000) == 100003, "");
+  EXPECT_EQ(maglev::next_prime(0), 2);
+  EXPECT_EQ(maglev::next_prime(3), 3);
+  EXPECT_EQ(maglev::next_prime(65536), 65537);
+  EXPECT_EQ(maglev::next_prime(1ULL << 32), 4294967311ULL);
 }
 
 struct empty_class {};
@@ -69,3 +85,145 @@ TEST(util, type_traits) {
   EXPECT_TRUE(maglev::is_weighted_v<weighted_void>);
   EXPECT_FALSE(maglev::is_weighted_v<weighted_bool>);
 }
+
+TEST(util, fast_mod) {
+  std::vector<unsigned long long> divisors{1,
+                                           2,
+                                           3,
+                                           997,
+                                           5003,
+                                           65537,
+                                           1000003,
+                                           4294967291ULL,
+                                           4294967311ULL,
+                                           (1ULL << 63) + 1,
+                                           ~0ULL};
+  std::vector<unsigned long long> nums{0, 1, 2, 996, 997, 65536, ~0ULL};
+  for (unsigned long long i = 0, x = 12345; i < 10000; ++i) {
+    x = maglev::maglev_int_hash<unsigned long long>{}(x);
+    nums.push_back(x);
+  }
+  for (auto d : divisors) {
+    maglev::fast_mod m(d);
+    EXPECT_EQ(m.divisor(), d);
+    for (auto a : nums) { EXPECT_EQ(m(a), a % d); }
+  }
+
+  maglev::const_mod<65537> cm;
+  for (auto a : nums) { EXPECT_EQ(cm(a), a % 65537); }
+}
+
+struct epoch_test_obj {
+  std::atomic<int>* deleted;
+  ~epoch_test_obj() { ++*deleted; }
+};
+
+TEST(util, epoch) {
+  auto&            d = maglev::epoch_domain::global();
+  std::atomic<int> deleted{0};
+
+  // deleted after epoch advanced twice
+  d.retire(new epoch_test_obj{&deleted});
+  d.collect();
+  d.collect();
+  EXPECT_EQ(deleted, 1);
+
+  std::atomic<int> stage{0};
+  std::thread      reader([&]() {
+    maglev::epoch_guard g;
+    {
+      maglev::epoch_guard nested;
+    }
+    stage = 1;
+    while (stage != 2) std::this_thread::yield();
+  });
+  while (stage != 1) std::this_thread::yield();
+  d.retire(new epoch_test_obj{&deleted});
+  for (int i = 0; i < 10; ++i) d.collect();
+  EXPECT_EQ(deleted, 1);  // reader in guard may still hold it
+  stage = 2;
+  reader.join();
+  d.collect();
+  d.collect();
+  EXPECT_EQ(deleted, 2);
+}
+
+struct alignas(128) aligned_test_obj {
+  char c;
+};
+
+TEST(util, aligned_new) {
+  // heap instances are aligned in C++14 too
+  std::vector<maglev::epoch_domain::record*> records;
+  for (int i = 0; i < 1000; ++i) {
+    records.push_back(new maglev::epoch_domain::record);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(records.back()) % 64, 0);
+  }
+  for (auto r : records) delete r;
+
+  maglev::aligned_allocator<aligned_test_obj> a;
+  for (int i = 0; i < 100; ++i) {
+    auto p = std::allocate_shared<aligned_test_obj>(a);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(p.get()) % 128, 0);
+    aligned_test_obj* q = a.allocate(3);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(q) % 128, 0);
+    a.deallocate(q, 3);
+  }
+}
+
+struct heartbeat_test_obj {
+  std::atomic<int> cnt{0};
+  void             heartbeat() { ++cnt; }
+};
+
+TEST(util, heartbeat_scheduler) {
+  using ms = std::chrono::milliseconds;
+  maglev::heartbeat_scheduler s(2, ms(1));
+  EXPECT_EQ(s.thread_num(), 2);
+
+  heartbeat_test_obj a, b;
+  auto               ia = s.add(a, ms(5));
+  auto               ib = s.add(b, ms(20), ms(5));
+  std::atomic<int>   slow{0};
+  auto               ic = s.add_task(
+      [&]() {
+        ++slow;
+        std::this_thread::sleep_for(ms(30));
+      },
+      ms(5));
+  EXPECT_EQ(s.task_size(), 3);
+
+  std::this_thread::sleep_for(ms(200));
+  maglev::heartbeat_scheduler::task_stats_t sa, sb, sc;
+  EXPECT_TRUE(s.stats(ia, sa));
+  EXPECT_TRUE(s.stats(ib, sb));
+  EXPECT_TRUE(s.stats(ic, sc));
+  EXPECT_GT(a.cnt, 5);
+  EXPECT_GT(b.cnt, 1);
+  EXPECT_GT(a.cnt, b.cnt);
+  EXPECT_LE(sa.heartbeat_cnt, size_t(a.cnt));
+  // a slow heartbeat is skipped rather than queued
+  EXPECT_GT(sc.overrun_cnt, 0);
+  EXPECT_GE(sc.max_duration, ms(30));
+  EXPECT_GE(sc.total_duration, sc.max_duration);
+
+  EXPECT_TRUE(s.remove(ic));
+  EXPECT_FALSE(s.remove(ic));
+  EXPECT_FALSE(s.stats(ic, sc));
+  int slow_cnt = slow;
+  EXPECT_TRUE(s.remove(ia));
+  int a_cnt = a.cnt;
+  std::this_thread::sleep_for(ms(50));
+  EXPECT_EQ(a.cnt, a_cnt);
+  EXPECT_EQ(slow, slow_cnt);
+  EXPECT_EQ(s.task_size(), 1);
+
+  // balancers
+  maglev::maglev_balancer<maglev::maglev_hasher<
+      maglev::load_stats_wrapper<maglev::node_base<int>, maglev::load_stats<>>>>
+      balancer;
+  auto id = s.add(balancer, ms(5));
+  std::this_thread::sleep_for(ms(50));
+  EXPECT_TRUE(s.remove(id));
+  EXPECT_GT(balancer.global_load().heartbeat_cnt(), 0);
+}